@@ -0,0 +1,57 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+/// A bounded, blocking FIFO queue used to hand blocks between the stages of
+/// the read/compute/write pipeline.
+template <class T>
+class BlockQueue
+{
+public:
+
+    explicit BlockQueue (std::size_t capacity)
+        : capacity(capacity), closed(false) {}
+
+    /// Push an element, blocking while the queue is full.
+    /// Return false if the queue was closed.
+    bool push (T x) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push_back(std::move(x));
+        not_empty.notify_one();
+        return true;
+    }
+
+    /// Pop an element, blocking while the queue is empty.
+    /// Return false if the queue is closed and has been drained.
+    bool pop (T& x) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty()) return false;
+        x = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    /// Close the queue. Pending elements can still be popped.
+    void close () {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    std::size_t capacity;
+    bool closed;
+};
@@ -1,10 +1,42 @@
 #include <kxhuffman/huffman.h>
 
+#include "BlockQueue.h"
+
 #include <string>
+#include <vector>
+#include <unordered_set>
 #include <fstream>
+#include <filesystem>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 using namespace kxh;
+namespace fs = std::filesystem;
+
+// Number of blocks that may be in flight between two pipeline stages.
+const std::size_t queue_depth = 4;
+
+// Default size of the blocks the input is split into when encoding.
+const std::size_t default_block_size = 1 << 20;
+
+/*
+ * The demo writes its output as a sequence of independently encoded blocks,
+ * so that reading, encoding and writing can overlap:
+ *
+ * [S0: num] [HEF blob of size S0]
+ * [S1: num] [HEF blob of size S1]
+ * ...
+ *
+ * until the end of the file.
+ */
 
 void filename_and_extension (const std::string& path,
                              std::string& name, std::string& extension)
@@ -22,60 +54,412 @@ void filename_and_extension (const std::string& path,
     }
 }
 
-std::string read_file (const char* path)
+/// Read up to 'size' bytes from the stream.
+BinaryBlob read_block (std::ifstream& f, std::size_t size)
 {
-    std::ifstream f(path, std::ios::binary);
-    f.seekg(0, std::ios::end);
-    std::size_t size = f.tellg();
-    f.seekg(0, std::ios::beg);
-    std::string data(size, 0);
+    BinaryBlob data(size, 0);
     f.read(&data[0], size);
+    data.resize(f.gcount());
     return data;
 }
 
-void write_file (const char* path, const std::string& data)
+/// Read the size of the next block frame written by the encoder.
+/// Return false at the end of the file.
+bool read_frame_size (std::ifstream& f, std::size_t& size)
+{
+    int type = f.get();
+    if (type == std::char_traits<char>::eof())
+        return false;
+
+    static const std::size_t num_sizes[] = { 1, 2, 4, 8 };
+    if (type < num_byte || type > num_qword)
+        throw std::runtime_error("invalid block frame");
+
+    // reuse the library's number decoder on the buffered bytes
+    U8 buf[1+8] = { (U8) type };
+    f.read((char*) &buf[1], num_sizes[type]);
+    if ((std::size_t) f.gcount() != num_sizes[type])
+        throw std::runtime_error("truncated block frame");
+    const U8* ptr = buf;
+    size = deserialise_num(ptr);
+    return true;
+}
+
+/// Read the next block frame written by the encoder.
+/// Return false at the end of the file.
+bool read_frame (std::ifstream& f, BinaryBlob& blob)
+{
+    std::size_t size;
+    if (!read_frame_size(f, size))
+        return false;
+
+    blob = read_block(f, size);
+    if (blob.size() != size)
+        throw std::runtime_error("truncated block frame");
+    return true;
+}
+
+/// Run the read/compute/write pipeline.
+/// The reader and writer run on their own threads so that reading block N+1,
+/// processing block N and writing block N-1 overlap.
+/// 'read' returns false when there is no more input.
+template <class read_fn, class process_fn>
+void run_pipeline (std::ofstream& out, read_fn read, process_fn process)
+{
+    BlockQueue<BinaryBlob> inputs(queue_depth);
+    BlockQueue<BinaryBlob> outputs(queue_depth);
+    std::exception_ptr reader_error, writer_error;
+
+    std::thread reader([&] {
+        try
+        {
+            BinaryBlob block;
+            while (read(block))
+                if (!inputs.push(std::move(block))) break;
+        }
+        catch (...) { reader_error = std::current_exception(); }
+        inputs.close();
+    });
+
+    std::thread writer([&] {
+        try
+        {
+            BinaryBlob block;
+            while (outputs.pop(block))
+            {
+                out.write(&block[0], block.size());
+                if (!out) throw std::runtime_error("write error");
+            }
+        }
+        catch (...) { writer_error = std::current_exception(); }
+        outputs.close();
+        inputs.close(); // stop the reader early on error
+    });
+
+    std::exception_ptr error;
+    try
+    {
+        BinaryBlob block;
+        while (inputs.pop(block))
+            if (!outputs.push(process(block))) break;
+    }
+    catch (...) { error = std::current_exception(); }
+    inputs.close();
+    outputs.close();
+
+    reader.join();
+    writer.join();
+
+    for (std::exception_ptr e : { error, reader_error, writer_error })
+        if (e) std::rethrow_exception(e);
+}
+
+void encode_file (const char* path, const std::string& out_path,
+                  std::size_t block_size)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error(std::string("cannot open ") + path);
+    std::ofstream out(out_path.c_str(), std::ios::binary);
+
+    std::size_t in_size = 0, out_size = 0;
+
+    auto read = [&] (BinaryBlob& block) {
+        block = read_block(in, block_size);
+        return !block.empty();
+    };
+
+    // blocks are processed in order, so the code is reused while the
+    // statistics of the file are steady
+    kxh::BlockEncoder<char> encoder;
+    auto process = [&] (const BinaryBlob& block) {
+        BinaryBlob blob = encoder.encode(block.begin(), block.end());
+        BinaryBlob frame = serialise_num(blob.size()) + blob;
+        in_size += block.size();
+        out_size += frame.size();
+        return frame;
+    };
+
+    run_pipeline(out, read, process);
+
+    double ratio = in_size == 0 ? 1.0 : (double) out_size / (double) in_size;
+    printf("Compression ratio: %f%%\n", ratio*100);
+}
+
+void decode_file (const char* path, const std::string& out_path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error(std::string("cannot open ") + path);
+    std::ofstream out(out_path.c_str(), std::ios::binary);
+
+    auto read = [&] (BinaryBlob& blob) {
+        return read_frame(in, blob);
+    };
+
+    // the blocks of a stream mostly share their tables
+    auto process = [] (const BinaryBlob& blob) {
+        BinaryBlob data;
+        kxh::decode<char>(blob, data, kxh::shared_decode_cache<char>());
+        return data;
+    };
+
+    run_pipeline(out, read, process);
+}
+
+/// Totals over all the files of a batch.
+struct BatchStats
+{
+    std::atomic<std::size_t> files{0};
+    std::atomic<std::size_t> failed{0};
+    std::atomic<std::size_t> in_bytes{0};
+    std::atomic<std::size_t> out_bytes{0};
+};
+
+/// A file being processed in batch mode.
+/// The file is split into blocks that are processed by independent tasks;
+/// the task that finishes the last block writes the output.
+struct BatchJob
+{
+    std::string path;
+    std::string out_path;
+    std::vector<std::pair<std::size_t,std::size_t>> blocks; // offset, size
+    std::vector<BinaryBlob> outputs; // one per block
+    std::atomic<std::size_t> remaining{0};
+    std::atomic<bool> failed{false};
+    std::mutex error_mutex;
+    std::string error;
+};
+
+void fail_job (BatchJob& job, const std::exception& e)
+{
+    std::lock_guard<std::mutex> lock(job.error_mutex);
+    if (job.error.empty()) job.error = e.what();
+    job.failed = true;
+}
+
+/// Write the job's output once all of its blocks are done.
+void finish_job (BatchJob& job, BatchStats& stats)
+{
+    try
+    {
+        if (!job.failed)
+        {
+            std::ofstream out(job.out_path.c_str(), std::ios::binary);
+            std::size_t out_size = 0;
+            for (const BinaryBlob& block : job.outputs)
+            {
+                out.write(block.data(), block.size());
+                out_size += block.size();
+            }
+            if (!out) throw std::runtime_error("write error");
+
+            std::size_t in_size = 0;
+            for (const auto& block : job.blocks)
+                in_size += block.second;
+            stats.in_bytes += in_size;
+            stats.out_bytes += out_size;
+            stats.files++;
+            return;
+        }
+    }
+    catch (const std::exception& e) { fail_job(job, e); }
+
+    stats.failed++;
+    fprintf(stderr, "%s: %s\n", job.path.c_str(), job.error.c_str());
+}
+
+/// Submit one task per block of the job.
+void submit_blocks (ThreadPool& pool, std::shared_ptr<BatchJob> job,
+                    BatchStats& stats, bool encoding)
+{
+    job->outputs.resize(job->blocks.size());
+    job->remaining = job->blocks.size();
+    if (job->blocks.empty())
+    {
+        finish_job(*job, stats);
+        return;
+    }
+
+    for (std::size_t i = 0; i < job->blocks.size(); ++i)
+    {
+        pool.submit([job, i, &stats, encoding] {
+            try
+            {
+                if (!job->failed)
+                {
+                    std::ifstream in(job->path.c_str(), std::ios::binary);
+                    in.seekg(job->blocks[i].first);
+                    BinaryBlob block = read_block(in, job->blocks[i].second);
+                    if (block.size() != job->blocks[i].second)
+                        throw std::runtime_error("short read");
+
+                    if (encoding)
+                    {
+                        BinaryBlob blob = kxh::encode<char>(block.begin(), block.end());
+                        job->outputs[i] = serialise_num(blob.size()) + blob;
+                    }
+                    else kxh::decode<char>(block, job->outputs[i],
+                                           kxh::shared_decode_cache<char>());
+                }
+            }
+            catch (const std::exception& e) { fail_job(*job, e); }
+
+            if (--job->remaining == 0)
+                finish_job(*job, stats);
+        });
+    }
+}
+
+/// Split the file into blocks and process them on the pool.
+void submit_file (ThreadPool& pool, const std::string& path,
+                  std::size_t block_size, BatchStats& stats)
+{
+    pool.submit([&pool, path, block_size, &stats] {
+        auto job = std::make_shared<BatchJob>();
+        job->path = path;
+        try
+        {
+            std::string filename, extension;
+            filename_and_extension(path, filename, extension);
+            bool encoding = extension != "hef";
+
+            if (encoding)
+            {
+                job->out_path = path + ".hef";
+                std::size_t size = fs::file_size(path);
+                for (std::size_t o = 0; o < size; o += block_size)
+                    job->blocks.emplace_back(o, std::min(block_size, size - o));
+            }
+            else
+            {
+                // locate the frames; their payloads are read by the block tasks
+                job->out_path = filename;
+                std::ifstream in(path.c_str(), std::ios::binary);
+                if (!in) throw std::runtime_error("cannot open file");
+                std::size_t size;
+                while (read_frame_size(in, size))
+                {
+                    job->blocks.emplace_back((std::size_t) in.tellg(), size);
+                    in.seekg(size, std::ios::cur);
+                }
+            }
+
+            submit_blocks(pool, job, stats, encoding);
+        }
+        catch (const std::exception& e)
+        {
+            fail_job(*job, e);
+            finish_job(*job, stats);
+        }
+    });
+}
+
+/// Return the path of the file the demo writes when processing 'path'.
+std::string output_path (const std::string& path)
 {
-    std::ofstream f(path, std::ios::binary);
-    f.write(&data[0], data.size());
+    std::string filename, extension;
+    filename_and_extension(path, filename, extension);
+    return extension == "hef" ? filename : path + ".hef";
+}
+
+/// Encode or decode many files concurrently.
+/// Directories are walked recursively; '.hef' files are decoded, others
+/// encoded. Files whose output would overwrite another input of the batch
+/// are skipped.
+void run_batch (const std::vector<std::string>& paths, std::size_t block_size,
+                std::size_t num_threads)
+{
+    std::vector<std::string> files;
+    for (const std::string& path : paths)
+    {
+        if (fs::is_directory(path))
+        {
+            for (const auto& entry : fs::recursive_directory_iterator(path))
+                if (entry.is_regular_file())
+                    files.push_back(entry.path().string());
+        }
+        else files.push_back(path);
+    }
+    std::unordered_set<std::string> inputs(files.begin(), files.end());
+
+    BatchStats stats;
+    auto start = std::chrono::steady_clock::now();
+    {
+        ThreadPool pool(num_threads);
+        printf("Processing %zu files with %zu threads\n", files.size(), pool.size());
+        fflush(stdout);
+
+        for (const std::string& path : files)
+        {
+            if (inputs.count(output_path(path)))
+            {
+                fprintf(stderr, "%s: skipped, output is also an input\n", path.c_str());
+                stats.failed++;
+            }
+            else submit_file(pool, path, block_size, stats);
+        }
+        pool.wait();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    double mb_in  = stats.in_bytes  / (1024.0*1024.0);
+    double mb_out = stats.out_bytes / (1024.0*1024.0);
+    printf("Files: %zu processed, %zu failed\n", stats.files.load(), stats.failed.load());
+    printf("Input: %.2f MiB, output: %.2f MiB\n", mb_in, mb_out);
+    printf("Elapsed: %fs, throughput: %.2f MiB/s\n", elapsed.count(),
+           elapsed.count() > 0 ? mb_in / elapsed.count() : 0.0);
 }
 
 int main (int argc, const char** argv)
 {
     try
     {
-        if (argc != 2)
+        std::size_t block_size = default_block_size;
+        std::size_t num_threads = 0;
+        std::vector<std::string> paths;
+        for (int i = 1; i < argc; ++i)
+        {
+            if (strcmp(argv[i], "-b") == 0 && i+1 < argc)
+                block_size = strtoul(argv[++i], nullptr, 10);
+            else if (strcmp(argv[i], "-j") == 0 && i+1 < argc)
+                num_threads = strtoul(argv[++i], nullptr, 10);
+            else
+                paths.push_back(argv[i]);
+        }
+
+        if (paths.empty() || block_size == 0)
         {
-            fprintf(stderr, "Usage: %s <file>\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-b block_size] [-j threads] <path>...\n", argv[0]);
             return 0;
         }
 
-        const char* path = argv[1];
+        // many files or directories go to the thread pool
+        if (paths.size() > 1 || fs::is_directory(paths[0]))
+        {
+            run_batch(paths, block_size, num_threads);
+            return 0;
+        }
+
+        const char* path = paths[0].c_str();
         std::string filename, extension;
         filename_and_extension(path, filename, extension);
 
+        auto start = std::chrono::steady_clock::now();
+
         if (extension != "hef")
         {
             printf("Encoding %s\n", path);
             fflush(stdout);
-
-            std::string data = read_file(path);
-            BinaryBlob blob = kxh::encode<char>(data.begin(), data.end());
-            std::string out = std::string(path) + ".hef";
-            write_file(out.c_str(), blob);
-
-            double ratio = (double) blob.size() / (double) data.size();
-            printf("Compression ratio: %f%%\n", ratio*100);
+            encode_file(path, std::string(path) + ".hef", block_size);
         }
         else
         {
             printf("Decoding %s\n", path);
             fflush(stdout);
-
-            BinaryBlob blob = read_file(path);
-            std::string data;
-            kxh::decode<char>(blob, data);
-            write_file(filename.c_str(), data);
+            decode_file(path, filename);
         }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("Elapsed: %fs\n", elapsed.count());
     }
     catch (const std::exception& e)
     {
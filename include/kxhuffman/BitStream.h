@@ -0,0 +1,311 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace kxh
+{
+
+/// Load a little-endian 64-bit word from unaligned memory.
+inline U64 load_le64 (const U8* p)
+{
+    U64 x;
+    memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+/// Load a big-endian 64-bit word from unaligned memory.
+inline U64 load_be64 (const U8* p)
+{
+    U64 x;
+    memcpy(&x, p, sizeof(x));
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+/// Store a 64-bit word to unaligned memory in big-endian order.
+inline void store_be64 (U8* p, U64 x)
+{
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    memcpy(p, &x, sizeof(x));
+}
+
+/// Store a 32-bit word to unaligned memory in little-endian order.
+inline void store_le32 (U8* p, U32 x)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap32(x);
+#endif
+    memcpy(p, &x, sizeof(x));
+}
+
+/// Write bits, most significant bit first, to a byte output iterator.
+/// Only whole bytes are written to the iterator; flush() pads the last byte
+/// with zeros.
+template <class out_iter_t>
+class BitWriter
+{
+public:
+
+    explicit BitWriter (out_iter_t out)
+        : out(out), acc(0), count(0) {}
+
+    /// Write the 'num_bits' least significant bits of 'bits'.
+    /// Pre: num_bits <= 32.
+    void write (U64 bits, std::size_t num_bits) {
+        DEBUG_ASSERT(num_bits <= 32);
+        acc = (acc << num_bits) | bits;
+        count += num_bits;
+        while (count >= 8)
+        {
+            count -= 8;
+            *out = (char) (acc >> count);
+            ++out;
+        }
+    }
+
+    /// Write a bit.
+    void write_bit (bool x) {
+        write(x ? 1 : 0, 1);
+    }
+
+    /// Write the pending bits, padded with zeros to a whole byte.
+    /// Return the output iterator past the last byte written.
+    out_iter_t flush () {
+        if (count > 0)
+            write(0, 8 - count);
+        return out;
+    }
+
+private:
+
+    out_iter_t out;
+    U64 acc;           // pending bits, right-aligned
+    std::size_t count; // number of pending bits, in [0,8)
+};
+
+/// Read bits, most significant bit first, from a byte input iterator.
+/// Bytes are consumed one at a time, so single-pass iterators are fine.
+template <class in_iter_t>
+class BitReader
+{
+public:
+
+    BitReader (in_iter_t begin, in_iter_t end)
+        : begin(begin), end(end), byte(0), count(0) {}
+
+    /// Read a bit.
+    /// Throw if the input is exhausted.
+    bool read_bit () {
+        if (count == 0)
+        {
+            if (begin == end)
+                throw std::runtime_error("truncated bit stream");
+            byte = (U8) *begin;
+            ++begin;
+            count = 8;
+        }
+        count--;
+        return (byte >> count) & 1;
+    }
+
+    /// Read 'num_bits' bits, returned right-aligned.
+    /// Pre: num_bits <= 64.
+    U64 read_bits (std::size_t num_bits) {
+        U64 bits = 0;
+        for (std::size_t i = 0; i < num_bits; ++i)
+            bits = (bits << 1) | (U64) read_bit();
+        return bits;
+    }
+
+    bool operator() () {
+        return read_bit();
+    }
+
+private:
+
+    in_iter_t begin;
+    in_iter_t end;
+    U8 byte;           // current byte
+    std::size_t count; // number of unread bits in the current byte
+};
+
+/// Iterate over the bits of a byte array, most significant bit first.
+class BitIterator
+{
+public:
+
+    BitIterator (const U8* data, std::size_t index)
+        : data(data), index(index) {}
+
+    bool operator== (const BitIterator& that) const {
+        return index == that.index;
+    }
+
+    bool operator!= (const BitIterator& that) const {
+        return index != that.index;
+    }
+
+    BitIterator& operator++ () {
+        index++;
+        return *this;
+    }
+
+    bool operator* () const {
+        return (data[index >> 3] >> (7 - (index & 7))) & 1;
+    }
+
+    /// Return the index of the current bit.
+    std::size_t position () const {
+        return index;
+    }
+
+private:
+
+    const U8* data;
+    std::size_t index;
+};
+
+/// Write bits, least significant bit first, to a blob.
+/// Bits are flushed 32 at a time with a single store.
+class LsbBitWriter
+{
+public:
+
+    explicit LsbBitWriter (std::pmr::string& out)
+        : out(out), acc(0), count(0), total(0) {}
+
+    /// Write the 'num_bits' least significant bits of 'bits'.
+    /// Pre: num_bits <= 32 and bits < 2^num_bits.
+    void write (U64 bits, std::size_t num_bits) {
+        DEBUG_ASSERT(num_bits <= 32);
+        acc |= bits << count;
+        count += num_bits;
+        total += num_bits;
+        if (count >= 32)
+        {
+            U8 word[4];
+            store_le32(word, (U32) acc);
+            out.append((const char*) word, 4);
+            acc >>= 32;
+            count -= 32;
+        }
+    }
+
+    /// Write the pending bits, padded with zeros to a whole byte.
+    /// Return the number of bits written, excluding the padding.
+    std::size_t flush () {
+        for (; count > 0; count = count > 8 ? count - 8 : 0)
+        {
+            out += (char) acc;
+            acc >>= 8;
+        }
+        return total;
+    }
+
+private:
+
+    std::pmr::string& out;
+    U64 acc;           // pending bits, the first one in the least significant bit
+    std::size_t count; // number of pending bits, in [0,32)
+    std::size_t total; // number of bits written
+};
+
+/// A code in LSB-first order: the first bit of the code is the least
+/// significant bit of 'bits'.
+struct LsbCode
+{
+    U64 bits = 0;
+    U8 length = 0;
+};
+
+/// Write the code to the LSB-first writer.
+inline void write_lsb_code (LsbBitWriter& writer, const LsbCode& c)
+{
+    if (c.length <= 32)
+        writer.write(c.bits, c.length);
+    else
+    {
+        writer.write(c.bits & 0xFFFFFFFF, 32);
+        writer.write(c.bits >> 32, c.length - 32);
+    }
+}
+
+/// Iterate over the first 'size' bits of a byte array, least significant bit
+/// first. Bits are buffered a 64-bit word at a time, refilled with a single
+/// unaligned load and a shift.
+class LsbBitIterator
+{
+public:
+
+    LsbBitIterator (const U8* data, std::size_t size, std::size_t index)
+        : data(data), num_bytes((size+7)/8), index(index), buf(0), count(0)
+    {
+        refill();
+    }
+
+    bool operator== (const LsbBitIterator& that) const {
+        return index == that.index;
+    }
+
+    bool operator!= (const LsbBitIterator& that) const {
+        return index != that.index;
+    }
+
+    LsbBitIterator& operator++ () {
+        buf >>= 1;
+        index++;
+        if (--count == 0)
+            refill();
+        return *this;
+    }
+
+    bool operator* () const {
+        return buf & 1;
+    }
+
+    /// Return the index of the current bit.
+    std::size_t position () const {
+        return index;
+    }
+
+private:
+
+    void refill () {
+        std::size_t byte = index >> 3;
+        std::size_t shift = index & 7;
+        if (byte + 8 <= num_bytes)
+        {
+            buf = load_le64(data + byte) >> shift;
+            count = 64 - shift;
+        }
+        else // tail of the array
+        {
+            buf = 0;
+            std::size_t n = 0;
+            for (; byte + n < num_bytes; ++n)
+                buf |= (U64) data[byte + n] << (8*n);
+            buf >>= shift;
+            count = n > 0 ? 8*n - shift : 0;
+        }
+    }
+
+    const U8* data;
+    std::size_t num_bytes;
+    std::size_t index;
+    U64 buf;           // buffered bits, the current one in the least significant bit
+    std::size_t count; // number of buffered bits
+};
+
+} // namespace kxh
@@ -3,8 +3,10 @@
 #include "common.h"
 
 #include <vector>
+#include <memory_resource>
 #include <cstdint>
 #include <limits>
+#include <utility>
 
 namespace kxh
 {
@@ -13,15 +15,32 @@ using Block = std::uint64_t;
 const Block leftmost = (Block) std::numeric_limits<std::int64_t>::min();
 const int bpp = sizeof(Block)*8; // bits per block
 
+/// A code of at most bpp bits, right-aligned, most significant bit first.
+struct Code
+{
+    Block bits = 0;
+    U8 length = 0;
+};
+
+/// A sequence of bits.
+/// The bit sequence is allocator-aware: containers with a polymorphic
+/// allocator, like Table, allocate their bit sequences from their own
+/// memory resource.
 class Bitseq
 {
 public:
 
+    using allocator_type = std::pmr::polymorphic_allocator<Block>;
+
     // iterate over the bits of the bit sequence
     class const_iterator
     {
     public:
 
+        bool operator== (const const_iterator& that) const {
+            return index == that.index;
+        }
+
         bool operator!= (const const_iterator& that) const {
             return index != that.index;
         }
@@ -48,18 +67,45 @@ public:
 
 public:
 
-    Bitseq ()
-        : count(0)
+    explicit Bitseq (const allocator_type& alloc = {})
+        : blocks(alloc), count(0)
     {
         blocks.push_back(0);
     }
 
+    Bitseq (const Bitseq& that, const allocator_type& alloc = {})
+        : blocks(that.blocks, alloc), count(that.count) {}
+
+    Bitseq (Bitseq&& that) = default;
+
+    Bitseq (Bitseq&& that, const allocator_type& alloc)
+        : blocks(std::move(that.blocks), alloc), count(that.count) {}
+
+    /// Construct a bit sequence of 'size' bits from its blocks.
+    /// Pre: blocks.size() is the number of blocks needed to hold 'size' bits,
+    /// or 1 if size = 0, and the bits past 'size' are 0.
+    Bitseq (std::pmr::vector<Block> blocks, std::size_t size)
+        : blocks(std::move(blocks))
+    {
+        if (this->blocks.empty())
+            this->blocks.push_back(0);
+        count = size == 0 ? 0 : size - (this->blocks.size()-1)*bpp;
+        DEBUG_ASSERT(size == 0 || (count > 0 && count <= bpp));
+    }
+
     Bitseq& operator= (const Bitseq& that) {
         blocks = that.blocks;
         count = that.count;
         return *this;
     }
 
+    Bitseq& operator= (Bitseq&& that) = default;
+
+    /// Return the allocator of the bit sequence.
+    allocator_type get_allocator () const {
+        return blocks.get_allocator();
+    }
+
     /// Push a bit.
     void push_bit (bool x) {
         if (count == bpp) // ran out of bits for current block
@@ -104,6 +150,30 @@ public:
         }
     }
 
+    /// Push the 'num_bits' least significant bits of 'bits', most significant
+    /// bit first.
+    /// Pre: num_bits in [1,bpp].
+    void push_bits (Block bits, std::size_t num_bits) {
+        DEBUG_ASSERT(num_bits > 0 && num_bits <= bpp);
+        // bits must be placed in the upper bits of the block
+        Block block = bits << (bpp-num_bits);
+        if (count + num_bits <= bpp) // fits in current block
+        {
+            blocks.back() |= (block >> count);
+            count += num_bits;
+        }
+        else
+        {
+            DEBUG_ASSERT(count > 0); // otherwise all bits fit
+            std::size_t fit = bpp-count;
+            if (fit > 0)
+                blocks.back() |= (block >> count);
+            blocks.push_back(block << fit);
+            count = num_bits - fit;
+        }
+        DEBUG_ASSERT(count > 0 && count <= bpp);
+    }
+
     /// Push a bit sequence.
     void push_seq (const Bitseq& seq) {
         if (seq.count == 0) return; // empty bitseq, nothing to copy
@@ -170,6 +240,12 @@ public:
         blocks.reserve(size/bpp + 1); // just add 1, it's easier...
     }
 
+    /// Return the blocks of the sequence, its first bit in the most
+    /// significant bit of the first block. Bits past size() are zero.
+    const Block* data () const {
+        return blocks.data();
+    }
+
     /// Return an iterator to the beginning of the sequence.
     const_iterator begin () const {
         return const_iterator(*this, 0);
@@ -184,7 +260,7 @@ private:
 
     // the blocks in the bitseq.
     // there is always at least 1 block, even in an empty bitseq.
-    std::vector<Block> blocks;
+    std::pmr::vector<Block> blocks;
 
     // the number of relevant bits in the current block, in [0,bpp].
     // if count = 0, the bitseq is empty.
@@ -1,43 +1,81 @@
 #pragma once
 
-#include <memory>
+#include <memory_resource>
+#include <new>
+#include <utility>
 
 namespace kxh
 {
 
+/// Construct an object in memory allocated from the resource.
+template <class U, class... Args>
+U* make_in (std::pmr::memory_resource* mr, Args&&... args)
+{
+    void* p = mr->allocate(sizeof(U), alignof(U));
+    try
+    {
+        return new (p) U(std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        mr->deallocate(p, sizeof(U), alignof(U));
+        throw;
+    }
+}
+
+/// Destroy an object constructed with make_in().
+template <class U>
+void destroy_in (std::pmr::memory_resource* mr, U* p)
+{
+    if (!p) return;
+    p->~U();
+    mr->deallocate(p, sizeof(U), alignof(U));
+}
+
 /// A node in a Huffman tree.
+/// The node owns its element and children, which are allocated from its
+/// memory resource.
 template <class T>
 class node
 {
 public:
 
-    node (T* e = nullptr, node<T>* l = nullptr, node<T>* r = nullptr)
-        : elem_(e), left_(l), right_(r) {}
+    explicit node (std::pmr::memory_resource* mr, node<T>* l = nullptr, node<T>* r = nullptr)
+        : mr(mr), elem_(nullptr), left_(l), right_(r) {}
+
+    node (const node&) = delete;
+    node& operator= (const node&) = delete;
+
+    ~node () {
+        destroy_in(mr, elem_);
+        destroy_in(mr, left_);
+        destroy_in(mr, right_);
+    }
 
     /// Create the node's left child if it does not exist, then return it.
     node<T>* safe_left () {
-        if (!left_.get())
-            left_.reset(new node<T>());
-        return left_.get();
+        if (!left_)
+            left_ = make_in<node<T>>(mr, mr);
+        return left_;
     }
 
     /// Create the node's right child if it does not exist, then return it.
     node<T>* safe_right () {
-        if (!right_.get())
-            right_.reset(new node<T>());
-        return right_.get();
+        if (!right_)
+            right_ = make_in<node<T>>(mr, mr);
+        return right_;
     }
 
     /// Return the node's left child.
     /// Return null if the node is a leaf.
     const node<T>* left () const {
-        return left_.get();
+        return left_;
     }
 
     /// Return the node's right child.
     /// Return null if the node is a leaf.
     const node<T>* right () const {
-        return right_.get();
+        return right_;
     }
 
     /// Get the node's element.
@@ -47,8 +85,10 @@ public:
     }
 
     /// Set the node's element.
-    void set_elem (T* e) {
-        elem_.reset(e);
+    void set_elem (const T& e) {
+        destroy_in(mr, elem_);
+        elem_ = nullptr;
+        elem_ = make_in<T>(mr, e);
     }
 
     /// Return true if the node is a leaf, false otherwise.
@@ -58,9 +98,10 @@ public:
 
 private:
 
-    std::unique_ptr<T> elem_;
-    std::unique_ptr<node<T>> left_;
-    std::unique_ptr<node<T>> right_;
+    std::pmr::memory_resource* mr;
+    T* elem_;
+    node<T>* left_;
+    node<T>* right_;
 };
 
 } // namespace kxh
@@ -2,25 +2,40 @@
 
 #include "HuffmanNode.h"
 #include "Bitseq.h"
+#include "cpu.h"
 
+#include <memory_resource>
 #include <unordered_map>
 #include <queue>
 #include <vector>
+#include <stdexcept>
 
 namespace kxh
 {
 
 /// Maps values to their binary representation.
+/// The codes are allocated from the table's memory resource.
 template <typename T>
-using Table = std::unordered_map<T,Bitseq>;
+using Table = std::pmr::unordered_map<T,Bitseq>;
 
 /// Maps values to their frequency in the input data.
+/// Counts are 64-bit, so that they are exact for inputs of any size.
 template <typename T>
-using FrequencyMap = std::unordered_map<T,int>;
+using FrequencyMap = std::pmr::unordered_map<T,U64>;
 
-/// Construct a Huffman tree from a sequence.
+/// Construct a Huffman tree from a frequency map, allocating its nodes from
+/// the resource.
+template <class T>
+node<T>* from_frequencies (const FrequencyMap<T>& freqs, std::pmr::memory_resource* mr);
+
+/// Construct a Huffman tree from a sequence, allocating its nodes from the
+/// resource.
 template <class T, class iter_t>
-node<T>* from_sequence (iter_t begin, const iter_t& end);
+node<T>* from_sequence (iter_t begin, const iter_t& end, std::pmr::memory_resource* mr);
+
+/// A Huffman tree.
+/// The tree, and the tables made from it, are allocated from the memory
+/// resource given at construction, which must outlive them.
 
 template <class T>
 class HuffmanTree
@@ -29,35 +44,133 @@ public:
 
     /// Construct a Huffman tree from a sequence.
     template <class iter_t>
-    HuffmanTree (iter_t begin, const iter_t& end)
-        : root(from_sequence<T>(begin, end)) {}
+    HuffmanTree (iter_t begin, const iter_t& end,
+                 std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+        : mr(mr), root(from_sequence<T>(begin, end, mr)) {}
+
+    /// Construct a Huffman tree from a frequency map.
+    explicit HuffmanTree (const FrequencyMap<T>& freqs,
+                          std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+        : mr(mr), root(from_frequencies(freqs, mr)) {}
 
     /// Construct a Huffman tree from a table.
-    HuffmanTree (const Table<T>& table);
+    HuffmanTree (const Table<T>& table,
+                 std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+    HuffmanTree (HuffmanTree&& that)
+        : mr(that.mr), root(that.root) {
+        that.root = nullptr;
+    }
+
+    HuffmanTree& operator= (HuffmanTree&& that) {
+        std::swap(mr, that.mr);
+        std::swap(root, that.root);
+        return *this;
+    }
+
+    ~HuffmanTree () {
+        destroy_in(mr, root);
+    }
+
+    /// Return the memory resource the tree is allocated from.
+    std::pmr::memory_resource* resource () const {
+        return mr;
+    }
 
     /// Serialise the Huffman tree into a table.
     Table<T> make_table () const;
 
     /// Decode the bit sequence.
     template <class bits_iter_t, class data_cont_t>
-    void decode (bits_iter_t begin, const bits_iter_t& end, data_cont_t& data);
+    void decode (bits_iter_t begin, const bits_iter_t& end, data_cont_t& data) const;
+
+    /// Decode 'count' symbols from the bit sequence into 'out'.
+    /// Return the output iterator past the last decoded symbol.
+    template <class bits_iter_t, class out_iter_t>
+    out_iter_t decode (bits_iter_t begin, const bits_iter_t& end,
+                       std::size_t count, out_iter_t out) const;
+
+    /// Decode a symbol from the bit sequence, advancing 'begin' past its code.
+    /// The returned reference is valid for the lifetime of the tree.
+    template <class bits_iter_t>
+    const T& decode_symbol (bits_iter_t& begin, const bits_iter_t& end) const;
 
 private:
 
-    std::unique_ptr<node<T>> root;
+    std::pmr::memory_resource* mr;
+    node<T>* root;
+};
+
+/// Count the symbols of the sequence into the frequency map.
+template <class T, class iter_t, int N = sizeof(T)>
+struct count_symbols
+{
+    static void count (iter_t begin, const iter_t& end, FrequencyMap<T>& freqs)
+    {
+        for (; begin != end; ++begin) freqs[*begin]++;
+    }
+};
+
+// specialise for T s.t. sizeof(T) = 1
+template <class T, class iter_t>
+struct count_symbols<T, iter_t, 1>
+{
+    static void count (iter_t begin, const iter_t& end, FrequencyMap<T>& freqs)
+    {
+        // histogram the bytes a buffer at a time, then fill the map once
+        U64 counts[256] = {};
+        U8 buf[4096];
+        while (begin != end)
+        {
+            std::size_t n = 0;
+            for (; n < sizeof(buf) && begin != end; ++begin)
+                buf[n++] = (U8) *begin;
+            kernels().histogram(buf, n, counts);
+        }
+        for (std::size_t b = 0; b < 256; ++b)
+            if (counts[b] > 0)
+                freqs[(T) (U8) b] = counts[b];
+    }
 };
 
 /// Compute the sequence's frequency map.
 template <class T, class iter_t>
-FrequencyMap<T> compute_frequencies (iter_t begin, const iter_t& end)
+FrequencyMap<T> compute_frequencies (iter_t begin, const iter_t& end,
+                                     std::pmr::memory_resource* mr = std::pmr::get_default_resource())
 {
-    FrequencyMap<T> freqs;
-    for (; begin != end; ++begin) freqs[*begin]++;
+    FrequencyMap<T> freqs(mr);
+    count_symbols<T,iter_t>::count(begin, end, freqs);
     return freqs;
 }
 
+/// Scale the counts down, halving them and rounding up, until they sum to
+/// at most 'max_total', for tree builders of bounded precision. Every symbol
+/// keeps a count of at least 1, and the order of the counts is preserved.
+/// Return the new sum.
+/// Throw std::invalid_argument if 'max_total' is less than the number of
+/// symbols.
+template <class T>
+U64 rescale_frequencies (FrequencyMap<T>& freqs, U64 max_total)
+{
+    if (max_total < freqs.size())
+        throw std::invalid_argument("frequency total below the number of symbols");
+    U64 total = 0;
+    for (const auto& keyval : freqs)
+        total += keyval.second;
+    while (total > max_total)
+    {
+        total = 0;
+        for (auto& keyval : freqs)
+        {
+            keyval.second = keyval.second / 2 + keyval.second % 2;
+            total += keyval.second;
+        }
+    }
+    return total;
+}
+
 template <typename T>
-using qelem = std::pair<node<T>*,int>;
+using qelem = std::pair<node<T>*,U64>;
 
 /// Compare two nodes using their frequencies.
 template <typename T>
@@ -68,19 +181,18 @@ struct node_cmp
     }
 };
 
-/// Construct a Huffman tree from a sequence.
-template <class T, class iter_t>
-node<T>* from_sequence (iter_t begin, const iter_t& end)
+/// Construct a Huffman tree from a frequency map.
+template <class T>
+node<T>* from_frequencies (const FrequencyMap<T>& freqs, std::pmr::memory_resource* mr)
 {
-    FrequencyMap<T> freqs = compute_frequencies<T>(begin, end);
-
-    using node_queue = std::priority_queue<qelem<T>, std::vector<qelem<T>>, node_cmp<T>>;
-    node_queue q;
+    using node_queue = std::priority_queue<qelem<T>, std::pmr::vector<qelem<T>>, node_cmp<T>>;
+    node_queue q{node_cmp<T>(), std::pmr::vector<qelem<T>>(mr)};
 
     // Create a leaf for every symbol and put it in the queue.
     for (const auto& keyval : freqs)
     {
-        node<T>* n = new node<T>(new T(keyval.first));
+        node<T>* n = make_in<node<T>>(mr, mr);
+        n->set_elem(keyval.first);
         qelem<T> p = std::make_pair(n, keyval.second);
         q.push(p);
     }
@@ -93,7 +205,7 @@ node<T>* from_sequence (iter_t begin, const iter_t& end)
         qelem<T> p2 = q.top();
         q.pop();
 
-        node<T>* n = new node<T>(nullptr, p1.first, p2.first);
+        node<T>* n = make_in<node<T>>(mr, mr, p1.first, p2.first);
         qelem<T> p = std::make_pair(n, p1.second + p2.second);
         q.push(p);
     }
@@ -101,6 +213,13 @@ node<T>* from_sequence (iter_t begin, const iter_t& end)
     return q.top().first;
 }
 
+/// Construct a Huffman tree from a sequence.
+template <class T, class iter_t>
+node<T>* from_sequence (iter_t begin, const iter_t& end, std::pmr::memory_resource* mr)
+{
+    return from_frequencies(compute_frequencies<T>(begin, end, mr), mr);
+}
+
 /// Construct the path as described by 'path' rooted at the node
 /// and insert the given element.
 template <class T>
@@ -111,16 +230,24 @@ void make_path (node<T>* n, const T& elem, const Bitseq& path)
         if (path[i] == 0) n = n->safe_left();
         else              n = n->safe_right();
     }
-    n->set_elem(new T(elem));
+    n->set_elem(elem);
 }
 
 /// Construct a Huffman tree from a table.
 template <class T>
-HuffmanTree<T>::HuffmanTree (const Table<T>& table)
+HuffmanTree<T>::HuffmanTree (const Table<T>& table, std::pmr::memory_resource* mr)
+    : mr(mr), root(make_in<node<T>>(mr, mr))
 {
-    root.reset(new node<T>);
-    for (const auto& keyval : table)
-        make_path(root.get(), keyval.first, keyval.second);
+    try
+    {
+        for (const auto& keyval : table)
+            make_path(root, keyval.first, keyval.second);
+    }
+    catch (...)
+    {
+        destroy_in(mr, root);
+        throw;
+    }
 }
 
 /// Build a Huffman table.
@@ -155,18 +282,18 @@ void build_table (Table<T>& table, Bitseq& code, const node<T>* n)
 template <class T>
 Table<T> HuffmanTree<T>::make_table () const
 {
-    Table<T> table;
-    Bitseq code;
-    build_table<T>(table, code, root.get());
+    Table<T> table(mr);
+    Bitseq code(mr);
+    build_table<T>(table, code, root);
     return table;
 }
 
 /// Decode the bit sequence.
 template <class T> template <class bits_iter_t, class data_cont_t>
 void HuffmanTree<T>::decode (bits_iter_t begin, const bits_iter_t& end,
-                             data_cont_t& data)
+                             data_cont_t& data) const
 {
-    const node<T>* n = root.get();
+    const node<T>* n = root;
     for (; begin != end; ++begin)
     {
         if (*begin) n = n->right();
@@ -175,9 +302,40 @@ void HuffmanTree<T>::decode (bits_iter_t begin, const bits_iter_t& end,
         if (n->is_leaf())
         {
             data.push_back(n->elem());
-            n = root.get();
+            n = root;
         }
     }
 }
 
+/// Decode 'count' symbols from the bit sequence into 'out'.
+template <class T> template <class bits_iter_t, class out_iter_t>
+out_iter_t HuffmanTree<T>::decode (bits_iter_t begin, const bits_iter_t& end,
+                                   std::size_t count, out_iter_t out) const
+{
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        *out = decode_symbol(begin, end);
+        ++out;
+    }
+    return out;
+}
+
+/// Decode a symbol from the bit sequence.
+template <class T> template <class bits_iter_t>
+const T& HuffmanTree<T>::decode_symbol (bits_iter_t& begin, const bits_iter_t& end) const
+{
+    const node<T>* n = root;
+    while (!n->is_leaf())
+    {
+        if (begin == end)
+            throw std::runtime_error("truncated bit sequence");
+        if (*begin) n = n->right();
+        else        n = n->left();
+        ++begin;
+        if (!n)
+            throw std::runtime_error("invalid code in bit sequence");
+    }
+    return n->elem();
+}
+
 } // namespace kxh
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <stdexcept>
+
+namespace kxh
+{
+
+/// Maximum length of a code in a static code.
+const int static_max_bits = 32;
+
+/// A canonical Huffman code over the alphabet {0, 1, ..., N-1} that can be
+/// built at compile time.
+///
+/// Static codes are meant for fixed distributions known at build time, in the
+/// style of HPACK's static table. Both the encoding table and the decoding
+/// tables are computed by the constructor, so a constexpr StaticCode has no
+/// runtime setup cost and the encoded output carries no Huffman tree:
+///
+///     constexpr U8 lengths[4] = {1, 2, 3, 3};
+///     constexpr StaticCode<4> code(lengths);
+///     BinaryBlob blob = kxh::encode(code, data.begin(), data.end());
+///     kxh::decode<char>(code, blob, data);
+///
+/// Codes are assigned canonically, as in deflate: shorter codes come first,
+/// and codes of the same length are ordered by symbol.
+template <std::size_t N>
+class StaticCode
+{
+public:
+
+    static_assert(N > 0 && N <= 65536, "static code alphabet must have 1 to 65536 symbols");
+
+    /// Construct a canonical code from the code length of every symbol.
+    /// A length of 0 means that the symbol has no code.
+    /// Throw if a length exceeds static_max_bits or if the lengths do not
+    /// describe a prefix code, which fails compilation in a constexpr context.
+    constexpr StaticCode (const U8 (&lengths)[N])
+    {
+        for (std::size_t i = 0; i < N; ++i)
+        {
+            if (lengths[i] > static_max_bits)
+                throw std::length_error("static code length too large");
+            lengths_[i] = lengths[i];
+            counts_[lengths[i]]++;
+        }
+        counts_[0] = 0;
+
+        // check that the code is not over-subscribed
+        U64 left = 1;
+        for (int len = 1; len <= static_max_bits; ++len)
+        {
+            left <<= 1;
+            if (left < counts_[len])
+                throw std::invalid_argument("static code is over-subscribed");
+            left -= counts_[len];
+        }
+
+        // first code and first symbol slot of every length
+        U32 next_code[static_max_bits+1] = {};
+        std::size_t offset[static_max_bits+1] = {};
+        U32 code = 0;
+        for (int len = 1; len <= static_max_bits; ++len)
+        {
+            code = (code + counts_[len-1]) << 1;
+            next_code[len] = code;
+            offset[len] = offset[len-1] + counts_[len-1];
+            if (counts_[len] > 0)
+                max_length_ = len;
+        }
+
+        for (std::size_t i = 0; i < N; ++i)
+        {
+            U8 len = lengths_[i];
+            if (len == 0) continue;
+            codes_[i] = next_code[len]++;
+            symbols_[offset[len]++] = (U16) i;
+        }
+    }
+
+    /// Construct a canonical code from the frequency of every symbol.
+    /// Symbols with frequency 0 get no code.
+    static constexpr StaticCode from_frequencies (const U64 (&freqs)[N])
+    {
+        U8 lengths[N] = {};
+        huffman_lengths(freqs, lengths);
+        return StaticCode(lengths);
+    }
+
+    /// Return the code of the symbol, right-aligned.
+    constexpr U32 code (std::size_t symbol) const {
+        return codes_[symbol];
+    }
+
+    /// Return the length of the symbol's code, or 0 if it has no code.
+    constexpr U8 length (std::size_t symbol) const {
+        return lengths_[symbol];
+    }
+
+    /// Return the length of the longest code.
+    constexpr int max_length () const {
+        return max_length_;
+    }
+
+    /// Decode a symbol, reading one bit at a time from 'next_bit'.
+    /// Return N if the bits do not form a valid code.
+    template <class bit_source_t>
+    std::size_t decode_symbol (bit_source_t& next_bit) const
+    {
+        U32 code  = 0; // bits read so far
+        U32 first = 0; // first code of the current length
+        U32 index = 0; // index of the first code of the current length
+        for (int len = 1; len <= max_length_; ++len)
+        {
+            code |= (U32) next_bit();
+            U32 count = counts_[len];
+            if (code - first < count)
+                return symbols_[index + (code - first)];
+            index += count;
+            first += count;
+            first <<= 1;
+            code <<= 1;
+        }
+        return N;
+    }
+
+private:
+
+    /// Compute the Huffman code lengths of the given frequencies.
+    static constexpr void huffman_lengths (const U64 (&freqs)[N], U8 (&lengths)[N])
+    {
+        // nodes [0,N) are the leaves, nodes [N,2N) the internal nodes
+        U64 weight[2*N] = {};
+        std::size_t parent[2*N] = {};
+        bool active[2*N] = {};
+
+        std::size_t num_leaves = 0;
+        for (std::size_t i = 0; i < N; ++i)
+        {
+            weight[i] = freqs[i];
+            active[i] = freqs[i] > 0;
+            if (active[i]) num_leaves++;
+        }
+
+        if (num_leaves == 1) // a single symbol still needs a 1-bit code
+        {
+            for (std::size_t i = 0; i < N; ++i)
+                if (active[i]) lengths[i] = 1;
+            return;
+        }
+
+        // repeatedly merge the two lightest nodes
+        std::size_t next = N;
+        for (std::size_t m = 1; m < num_leaves; ++m)
+        {
+            std::size_t a = 2*N, b = 2*N;
+            for (std::size_t i = 0; i < next; ++i)
+            {
+                if (!active[i]) continue;
+                if (a == 2*N || weight[i] < weight[a]) { b = a; a = i; }
+                else if (b == 2*N || weight[i] < weight[b]) b = i;
+            }
+            weight[next] = weight[a] + weight[b];
+            active[next] = true;
+            active[a] = active[b] = false;
+            parent[a] = parent[b] = next;
+            next++;
+        }
+
+        // the root is the last node created; a leaf's length is its depth
+        std::size_t root = next-1;
+        for (std::size_t i = 0; i < N; ++i)
+        {
+            if (freqs[i] == 0) continue;
+            int depth = 0;
+            for (std::size_t n = i; n != root; n = parent[n])
+                depth++;
+            if (depth > static_max_bits)
+                throw std::length_error("static code length too large");
+            lengths[i] = (U8) depth;
+        }
+    }
+
+    U32 codes_[N] = {};
+    U8 lengths_[N] = {};
+    U32 counts_[static_max_bits+1] = {}; // number of codes of every length
+    U16 symbols_[N] = {}; // symbols sorted by code
+    int max_length_ = 0;
+};
+
+} // namespace kxh
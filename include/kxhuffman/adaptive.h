@@ -0,0 +1,353 @@
+/*
+ * Adaptive (single-pass) Huffman coding.
+ *
+ * kxh::encode() needs two passes over its input: one to count frequencies
+ * and one to encode. The adaptive coder instead learns the frequencies as it
+ * goes and rebuilds its code periodically, so it encodes in a single pass
+ * over single-pass input iterators (istreambuf_iterator, socket readers...).
+ * The decoder mirrors every update of the encoder and reads its input one
+ * byte at a time, so neither side ever buffers the whole stream.
+ *
+ * The code is first rebuilt after 16 symbols, then at intervals that double
+ * until they reach 'period' symbols. Symbols that have no code yet are sent
+ * as an escape code followed by their raw bytes. Memory is bounded by the
+ * size of the alphabet.
+ *
+ * Stream format:
+ *
+ * [P: U8]           // log2 of the rebuild period
+ * [c0c1...cK]       // one code per symbol, most significant bit first
+ * [ESC 1]           // end of stream
+ * [0...]            // zero padding to a whole byte
+ *
+ * where a symbol without a code is sent as [ESC 0 x], x being the symbol's
+ * sizeof(T) bytes in memory order.
+ */
+
+#pragma once
+
+#include "huffman.h"
+#include "BitStream.h"
+#include "common.h"
+
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include <queue>
+#include <functional>
+#include <iterator>
+#include <cstring>
+#include <stdexcept>
+
+namespace kxh
+{
+
+/// Default number of symbols between two rebuilds of the adaptive code.
+const std::size_t adaptive_period = 4096;
+
+/// Maximum length of a code in the adaptive code.
+const int adaptive_max_bits = 32;
+
+/// The symbol statistics and current code shared by the adaptive encoder and
+/// decoder. Both sides perform the same sequence of updates and therefore
+/// hold the same code at every point of the stream.
+///
+/// Symbols are numbered in order of first appearance; symbol 0 is the escape.
+/// The code is canonical over these numbers, so it does not depend on how
+/// the symbols hash.
+template <class T>
+class AdaptiveModel
+{
+public:
+
+    static const std::size_t escape = 0;
+
+    explicit AdaptiveModel (std::size_t period = adaptive_period)
+        : period(period), step(std::min<std::size_t>(16, period)),
+          next_rebuild(step), seen(0)
+    {
+        symbols.resize(1);
+        counts.push_back(0);
+        rebuild();
+    }
+
+    /// Return the number of the symbol, or escape if the symbol has no code.
+    std::size_t find (const T& x) const {
+        auto it = indices.find(x);
+        if (it == indices.end() || lengths[it->second] == 0)
+            return escape;
+        return it->second;
+    }
+
+    /// Return the number of the symbol, adding it to the model if necessary.
+    std::size_t add (const T& x) {
+        auto it = indices.find(x);
+        if (it != indices.end())
+            return it->second;
+        std::size_t i = symbols.size();
+        indices[x] = i;
+        symbols.push_back(x);
+        counts.push_back(0);
+        lengths.push_back(0);
+        codes.push_back(0);
+        return i;
+    }
+
+    /// Return the symbol with the given number.
+    const T& symbol (std::size_t i) const {
+        return symbols[i];
+    }
+
+    /// Return the code of the given symbol number, right-aligned.
+    U32 code (std::size_t i) const {
+        return codes[i];
+    }
+
+    /// Return the length of the code of the given symbol number.
+    U8 length (std::size_t i) const {
+        return lengths[i];
+    }
+
+    /// Count an occurrence of the given symbol number, and rebuild the code
+    /// if the period is over.
+    void update (std::size_t i) {
+        counts[i]++;
+        if (++seen == next_rebuild)
+        {
+            rebuild();
+            if (step < period)
+                step = std::min(2*step, period);
+            next_rebuild += step;
+        }
+    }
+
+    /// Decode a symbol number, reading one bit at a time from 'next_bit'.
+    template <class bit_source_t>
+    std::size_t decode_symbol (bit_source_t& next_bit) const
+    {
+        U32 code  = 0; // bits read so far
+        U32 first = 0; // first code of the current length
+        U32 index = 0; // index of the first code of the current length
+        for (std::size_t len = 1; len < length_counts.size(); ++len)
+        {
+            code |= (U32) next_bit();
+            U32 count = length_counts[len];
+            if (code - first < count)
+                return sorted[index + (code - first)];
+            index += count;
+            first += count;
+            first <<= 1;
+            code <<= 1;
+        }
+        throw std::runtime_error("invalid adaptive code");
+    }
+
+private:
+
+    /// Rebuild the code from the current counts.
+    void rebuild ()
+    {
+        // the escape is weighted by the number of distinct symbols
+        std::vector<U64> weights(counts);
+        weights[escape] = symbols.size();
+
+        while (!huffman_lengths(weights))
+        {
+            for (U64& w : weights) // flatten the distribution and retry
+                w = (w+1)/2;
+        }
+        canonical_codes();
+    }
+
+    /// Compute the Huffman code lengths of the symbols with non-zero weight.
+    /// Return false if a length exceeds adaptive_max_bits.
+    bool huffman_lengths (const std::vector<U64>& weights)
+    {
+        const std::size_t n = weights.size();
+        std::fill(lengths.begin(), lengths.end(), 0);
+        lengths.resize(n, 0);
+
+        // ties are broken by node number, so the code is deterministic
+        using qelem = std::pair<U64,std::size_t>;
+        std::priority_queue<qelem, std::vector<qelem>, std::greater<qelem>> q;
+        std::vector<std::size_t> parent(n);
+        for (std::size_t i = 0; i < n; ++i)
+            if (weights[i] > 0) q.push(qelem(weights[i], i));
+
+        if (q.size() == 1) // a single symbol still needs a 1-bit code
+        {
+            lengths[q.top().second] = 1;
+            return true;
+        }
+
+        while (q.size() > 1)
+        {
+            qelem a = q.top(); q.pop();
+            qelem b = q.top(); q.pop();
+            std::size_t node = parent.size();
+            parent.push_back(0);
+            parent[a.second] = parent[b.second] = node;
+            q.push(qelem(a.first + b.first, node));
+        }
+
+        const std::size_t root = parent.size()-1;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            if (weights[i] == 0) continue;
+            int depth = 0;
+            for (std::size_t node = i; node != root; node = parent[node])
+                depth++;
+            if (depth > adaptive_max_bits)
+                return false;
+            lengths[i] = (U8) depth;
+        }
+        return true;
+    }
+
+    /// Assign canonical codes from the code lengths.
+    void canonical_codes ()
+    {
+        std::size_t max_len = 0;
+        for (U8 len : lengths)
+            max_len = std::max<std::size_t>(max_len, len);
+
+        length_counts.assign(max_len+1, 0);
+        for (U8 len : lengths)
+            length_counts[len]++;
+        length_counts[0] = 0;
+
+        std::vector<U32> next_code(max_len+1, 0);
+        std::vector<U32> offset(max_len+1, 0);
+        U32 code = 0;
+        for (std::size_t len = 1; len <= max_len; ++len)
+        {
+            code = (code + length_counts[len-1]) << 1;
+            next_code[len] = code;
+            offset[len] = offset[len-1] + length_counts[len-1];
+        }
+
+        codes.assign(lengths.size(), 0);
+        sorted.resize(lengths.size());
+        for (std::size_t i = 0; i < lengths.size(); ++i)
+        {
+            U8 len = lengths[i];
+            if (len == 0) continue;
+            codes[i] = next_code[len]++;
+            sorted[offset[len]++] = (U32) i;
+        }
+    }
+
+    std::vector<T> symbols; // symbol numbers to symbols
+    std::unordered_map<T,std::size_t> indices; // symbols to symbol numbers
+    std::vector<U64> counts;
+
+    std::vector<U32> codes;
+    std::vector<U8> lengths;
+    std::vector<U32> length_counts; // number of codes of every length
+    std::vector<U32> sorted;        // symbol numbers sorted by code
+
+    std::size_t period;       // maximum number of symbols between rebuilds
+    std::size_t step;         // number of symbols until the next rebuild
+    std::size_t next_rebuild; // value of 'seen' at the next rebuild
+    std::size_t seen;         // number of symbols seen so far
+};
+
+/// Return log2 of the period, which must be a power of 2.
+inline U8 adaptive_period_bits (std::size_t period)
+{
+    if (period == 0 || (period & (period-1)) != 0)
+        throw std::invalid_argument("adaptive period must be a power of 2");
+    U8 bits = 0;
+    while ((std::size_t(1) << bits) < period)
+        bits++;
+    return bits;
+}
+
+/// Encode the sequence in a single pass, writing bytes to 'out'.
+/// 'period' is the maximum number of symbols between two rebuilds of the
+/// code and must be a power of 2.
+/// Return the output iterator past the last byte written.
+template <class T, class in_iter_t, class out_iter_t>
+out_iter_t adaptive_encode (in_iter_t begin, const in_iter_t& end, out_iter_t out,
+                            std::size_t period = adaptive_period)
+{
+    U8 period_bits = adaptive_period_bits(period);
+    AdaptiveModel<T> model(period);
+    BitWriter<out_iter_t> writer(out);
+    writer.write(period_bits, 8);
+
+    const std::size_t esc = AdaptiveModel<T>::escape;
+    for (; begin != end; ++begin)
+    {
+        const T x = *begin;
+        std::size_t i = model.find(x);
+        writer.write(model.code(i), model.length(i));
+        if (i == esc)
+        {
+            writer.write_bit(0); // literal
+            U8 raw[sizeof(T)];
+            memcpy(raw, &x, sizeof(T));
+            for (U8 b : raw)
+                writer.write(b, 8);
+            i = model.add(x);
+        }
+        model.update(i);
+    }
+
+    writer.write(model.code(esc), model.length(esc));
+    writer.write_bit(1); // end of stream
+    return writer.flush();
+}
+
+/// Decode a stream produced by adaptive_encode(), reading bytes from
+/// [begin,end) and writing symbols to 'out'.
+/// Return the output iterator past the last symbol written.
+template <class T, class in_iter_t, class out_iter_t>
+out_iter_t adaptive_decode (in_iter_t begin, const in_iter_t& end, out_iter_t out)
+{
+    BitReader<in_iter_t> reader(begin, end);
+    U8 period_bits = (U8) reader.read_bits(8);
+    if (period_bits >= sizeof(std::size_t)*8)
+        throw std::runtime_error("invalid adaptive period");
+    AdaptiveModel<T> model(std::size_t(1) << period_bits);
+
+    const std::size_t esc = AdaptiveModel<T>::escape;
+    for (;;)
+    {
+        std::size_t i = model.decode_symbol(reader);
+        if (i == esc)
+        {
+            if (reader.read_bit()) // end of stream
+                break;
+            U8 raw[sizeof(T)];
+            for (U8& b : raw)
+                b = (U8) reader.read_bits(8);
+            T x;
+            memcpy(&x, raw, sizeof(T));
+            i = model.add(x);
+        }
+        *out = model.symbol(i);
+        ++out;
+        model.update(i);
+    }
+    return out;
+}
+
+/// Encode the sequence in a single pass into a binary blob.
+template <class T, class iter_t>
+BinaryBlob adaptive_encode (iter_t begin, const iter_t& end)
+{
+    BinaryBlob blob;
+    adaptive_encode<T>(begin, end, std::back_inserter(blob));
+    return blob;
+}
+
+/// Decode a binary blob produced by adaptive_encode(), appending the symbols
+/// to the container.
+template <class T, class cont_t>
+void adaptive_decode (const BinaryBlob& blob, cont_t& cont)
+{
+    adaptive_decode<T>(blob.begin(), blob.end(), std::back_inserter(cont));
+}
+
+} // namespace kxh
@@ -0,0 +1,155 @@
+/*
+ * Block encoding with drift-aware table reuse.
+ *
+ * A stream encoded block by block with encode() pays for a frequency count,
+ * a tree and a table on every block, although on a steady stream the code
+ * hardly changes from one block to the next. BlockEncoder keeps the code
+ * across blocks and rebuilds it only when the statistics have drifted.
+ *
+ * The encoder keeps a running histogram of the stream, in which every block
+ * weighs half as much as the next one, and builds its codes from it. For
+ * every block, it counts the block's histogram, which encoding needs anyway,
+ * and compares in O(k) the cost of the block with the current code against
+ * the block's entropy. A Huffman code always costs a little more than the
+ * entropy; the code is rebuilt when that excess has grown by more than
+ * 'threshold' bits per symbol since the code was built, or when the block
+ * has a symbol without a code.
+ *
+ * Every block is a regular HEF blob; decoders need no change.
+ */
+
+#pragma once
+
+#include "huffman.h"
+#include "common.h"
+
+#include <cmath>
+#include <memory_resource>
+#include <iterator>
+
+namespace kxh
+{
+
+/// Default growth of the cost over the entropy, in bits per symbol, that
+/// triggers a rebuild of the code.
+const double block_rebuild_threshold = 0.02;
+
+/// Return the entropy of the histogram of 'n' symbols, in bits.
+template <class T>
+double entropy_bits (const FrequencyMap<T>& freqs, std::size_t n)
+{
+    double bits = 0;
+    for (const auto& keyval : freqs)
+        bits += keyval.second * std::log2((double) n / keyval.second);
+    return bits;
+}
+
+/// Encode a stream block by block, reusing the code while the statistics of
+/// the stream are steady.
+template <class T>
+class BlockEncoder
+{
+public:
+
+    explicit BlockEncoder (double threshold = block_rebuild_threshold,
+                           std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+        : threshold(threshold), mr(mr), history(mr), history_size(0),
+          table(mr), excess(0), num_blocks(0), num_rebuilds(0) {}
+
+    /// Encode the block into a HEF blob.
+    template <class iter_t>
+    BinaryBlob encode (iter_t begin, const iter_t& end)
+    {
+        FrequencyMap<T> freqs = compute_frequencies<T>(begin, end, mr);
+        const std::size_t n = std::distance(begin, end);
+        add_history(freqs);
+
+        std::size_t bits = 0;
+        bool covered = cost(freqs, bits);
+        double drift = covered && n > 0
+                     ? ((double) bits - entropy_bits(freqs, n)) / n - excess : 0;
+        if (n > 0 && (!covered || drift > threshold))
+            rebuild();
+        num_blocks++;
+
+        Bitseq code = encode_seq<T,iter_t>::encode(begin, end, table);
+        return serialise<T>(table, n, code);
+    }
+
+    /// Return the number of blocks encoded.
+    std::size_t blocks () const {
+        return num_blocks;
+    }
+
+    /// Return the number of times the code was built.
+    std::size_t rebuilds () const {
+        return num_rebuilds;
+    }
+
+    /// Return the current code.
+    const Table<T>& code_table () const {
+        return table;
+    }
+
+private:
+
+    /// Compute the number of bits needed to encode the histogram with the
+    /// current code.
+    /// Return false if a symbol has no code.
+    bool cost (const FrequencyMap<T>& freqs, std::size_t& bits) const
+    {
+        bits = 0;
+        for (const auto& keyval : freqs)
+        {
+            auto it = table.find(keyval.first);
+            if (it == table.end())
+                return false;
+            bits += (std::size_t) keyval.second * it->second.size();
+        }
+        return true;
+    }
+
+    /// Halve the running histogram and add the block's histogram to it.
+    void add_history (const FrequencyMap<T>& freqs)
+    {
+        history_size = 0;
+        for (auto it = history.begin(); it != history.end(); )
+        {
+            it->second /= 2;
+            history_size += it->second;
+            if (it->second == 0) it = history.erase(it);
+            else ++it;
+        }
+        for (const auto& keyval : freqs)
+        {
+            history[keyval.first] += keyval.second;
+            history_size += keyval.second;
+        }
+    }
+
+    /// Rebuild the code from the running histogram, and record its excess
+    /// over the entropy of the histogram.
+    void rebuild ()
+    {
+        HuffmanTree<T> tree(history, mr);
+        table = tree.make_table();
+        std::size_t bits = 0;
+        cost(history, bits);
+        excess = ((double) bits - entropy_bits(history, history_size)) / history_size;
+        num_rebuilds++;
+    }
+
+    double threshold;
+    std::pmr::memory_resource* mr;
+
+    FrequencyMap<T> history;  // running histogram
+    std::size_t history_size; // number of symbols in the running histogram
+
+    Table<T> table;           // the current code
+    double excess;            // bits per symbol over the entropy when the code was built
+
+    std::size_t num_blocks;
+    std::size_t num_rebuilds;
+};
+
+} // namespace kxh
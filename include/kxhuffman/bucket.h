@@ -0,0 +1,223 @@
+/*
+ * Bucketed coding of integers.
+ *
+ * encode() gives every distinct value a leaf of the tree, which for
+ * timestamps, identifiers or sizes means as many leaves as values: a table
+ * of sizeof(T)+1 bytes per value in the header, and a tree that does not fit
+ * in the cache. encode_bucketed() codes unsigned integers the way deflate
+ * codes lengths and distances: every value falls in one of a few
+ * logarithmic buckets, the bucket is Huffman-coded, and the position of the
+ * value in its bucket follows as raw extra bits.
+ *
+ * Values below 2^bucket_direct_bits are their own bucket, with no extra
+ * bits. Above, every power of two [2^e, 2^(e+1)) is split into
+ * 2^bucket_mantissa_bits buckets by the bits after the leading one, and the
+ * remaining e - bucket_mantissa_bits bits are the extra bits:
+ *
+ *   value      0 .. 15   16..23   24..31   32..47   ...   2^63+2^62 ..
+ *   bucket     0 .. 15   16       17       18       ...   135
+ *   extra      0         3        3        4        ...   62
+ *
+ * so that the alphabet has at most bucket_count symbols whatever the values,
+ * and the table and tree stay in a few cache lines.
+ *
+ * The output is a HEF blob with hef_bucketed set, whose alphabet is the
+ * buckets as U8 and whose data bits hold every code followed by its extra
+ * bits, most significant bit first. Buckets are decoded with a DecodeTable.
+ */
+
+#pragma once
+
+#include "huffman.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <limits>
+#include <memory_resource>
+#include <stdexcept>
+#include <type_traits>
+
+namespace kxh
+{
+
+/// Values below 2^bucket_direct_bits are their own bucket.
+const unsigned bucket_direct_bits = 4;
+
+/// Number of bits after the leading one that select the bucket of a larger
+/// value.
+const unsigned bucket_mantissa_bits = 1;
+
+/// Number of buckets of 64-bit values.
+const std::size_t bucket_count = (std::size_t(1) << bucket_direct_bits)
+    + ((64 - bucket_direct_bits) << bucket_mantissa_bits);
+
+/// Return the position of the leading one of the non-zero value.
+inline unsigned floor_log2 (U64 v)
+{
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(v);
+#else
+    unsigned e = 0;
+    while (v >>= 1) e++;
+    return e;
+#endif
+}
+
+/// Return the bucket of the value.
+inline U8 value_bucket (U64 v)
+{
+    if (v < (U64(1) << bucket_direct_bits))
+        return (U8) v;
+    unsigned e = floor_log2(v);
+    unsigned mantissa = (unsigned) (v >> (e - bucket_mantissa_bits))
+                      & ((1u << bucket_mantissa_bits) - 1);
+    return (U8) ((1u << bucket_direct_bits)
+                 + ((e - bucket_direct_bits) << bucket_mantissa_bits) + mantissa);
+}
+
+/// The values of a bucket: [base, base + 2^extra).
+struct Bucket
+{
+    U64 base = 0;
+    unsigned extra = 0; // number of extra bits
+};
+
+/// Return the values of the bucket, which must be below bucket_count.
+inline Bucket bucket_values (std::size_t b)
+{
+    Bucket bucket;
+    if (b < (std::size_t(1) << bucket_direct_bits))
+    {
+        bucket.base = b;
+        return bucket;
+    }
+    std::size_t k = b - (std::size_t(1) << bucket_direct_bits);
+    unsigned e = bucket_direct_bits + (unsigned) (k >> bucket_mantissa_bits);
+    U64 mantissa = k & ((std::size_t(1) << bucket_mantissa_bits) - 1);
+    bucket.extra = e - bucket_mantissa_bits;
+    bucket.base = ((U64(1) << bucket_mantissa_bits) | mantissa) << bucket.extra;
+    return bucket;
+}
+
+/// Read 'n' bits, n <= 64, most significant bit first at bit 'pos' of the
+/// 'num_bits' data bits, and advance 'pos' past them.
+/// Throw std::runtime_error if the data ends first.
+inline U64 read_bits (const U8* data, std::size_t num_bits, std::size_t& pos, unsigned n)
+{
+    if (n > num_bits - pos)
+        throw std::runtime_error("truncated bit sequence");
+    const std::size_t num_bytes = (num_bits+7)/8;
+    U64 v = 0;
+    while (n > 0)
+    {
+        // at most 56 bits, so that they fit in a word after the shift
+        unsigned k = std::min(n, 56u);
+        std::size_t byte = pos >> 3;
+        U64 word = 0;
+        if (byte + 8 <= num_bytes)
+            word = load_be64(data + byte);
+        else // tail of the data
+        {
+            for (std::size_t i = 0; byte + i < num_bytes; ++i)
+                word |= (U64) data[byte+i] << (56 - 8*i);
+        }
+        U64 bits = (word << (pos & 7)) >> (64 - k);
+        v = v << k | bits;
+        pos += k;
+        n -= k;
+    }
+    return v;
+}
+
+/// Encode the unsigned integers using Huffman coded buckets followed by
+/// extra bits. The iterators must be multi-pass.
+/// The memory used by the call, including the returned blob, is allocated
+/// from 'mr'.
+template <class T, class iter_t>
+BinaryBlob encode_bucketed (iter_t begin, const iter_t& end,
+                            std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    static_assert(std::is_unsigned<T>::value, "bucketed coding takes unsigned integers");
+
+    std::size_t counts[bucket_count] = {};
+    std::size_t num_symbols = 0;
+    for (iter_t it = begin; it != end; ++it, ++num_symbols)
+        counts[value_bucket((T) *it)]++;
+    FrequencyMap<U8> freqs(mr);
+    for (std::size_t b = 0; b < bucket_count; ++b)
+        if (counts[b] > 0)
+            freqs[(U8) b] = counts[b];
+    HuffmanTree<U8> tree(freqs, mr);
+    Table<U8> table = tree.make_table();
+
+    const CodeLookup<U8> codes(table);
+    Bucket buckets[bucket_count];
+    for (std::size_t b = 0; b < bucket_count; ++b)
+        buckets[b] = bucket_values(b);
+
+    Bitseq seq(mr);
+    for (; begin != end; ++begin)
+    {
+        U64 v = (T) *begin;
+        U8 b = value_bucket(v);
+        const Code& c = codes.codes[b];
+        if (c.length > 0)
+            seq.push_bits(c.bits, c.length);
+        if (buckets[b].extra > 0)
+            seq.push_bits(v, buckets[b].extra);
+    }
+
+    BinaryBlob blob = serialise_header(table, num_symbols, hef_bucketed);
+    blob += serialise_bitseq(seq);
+    return blob;
+}
+
+/// Decode the binary blob made by encode_bucketed().
+/// The decoded values are appended to the container, which is resized once.
+/// Throw std::runtime_error if the blob is not bucketed, or has a value that
+/// does not fit in T.
+template <class T, class cont_t>
+void decode_bucketed (const BinaryBlob& blob, cont_t& cont,
+                      std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    static_assert(std::is_unsigned<T>::value, "bucketed coding takes unsigned integers");
+
+    const U8* ptr = (const U8*) blob.c_str();
+    U8 F = *ptr++;
+    if (!(F & hef_bucketed) || (F & hef_lsb))
+        throw std::runtime_error("not a bucketed blob");
+    std::pmr::vector<U8> alphabet(mr);
+    std::pmr::vector<U8> lengths(mr);
+    Bitseq alphabits(mr);
+    deserialise_arrays(ptr, alphabet, lengths, alphabits);
+    std::size_t K = deserialise_num(ptr);
+    if (F & hef_indexed)
+        deserialise_index(ptr, K, nullptr);
+    const std::size_t M = deserialise_payload_size(ptr);
+
+    const DecodeTable<U8> table(make_table(alphabet, lengths, alphabits), false, mr);
+    std::pmr::vector<Bucket> buckets(table.size(), mr); // by symbol index
+    for (std::size_t i = 0; i < table.size(); ++i)
+    {
+        std::size_t b = table.symbol(i);
+        if (b >= bucket_count)
+            throw std::runtime_error("invalid bucket");
+        buckets[i] = bucket_values(b);
+        if (b > value_bucket(std::numeric_limits<T>::max()))
+            throw std::runtime_error("bucketed value too large for the symbol type");
+    }
+
+    std::size_t offset = cont.size();
+    cont.resize(offset + K);
+    auto out = cont.begin() + offset;
+    std::size_t pos = 0;
+    for (std::size_t i = 0; i < K; ++i, ++out)
+    {
+        const Bucket& b = buckets[table.next(ptr, M, pos)];
+        *out = (T) (b.extra > 0 ? b.base + read_bits(ptr, M, pos, b.extra) : b.base);
+    }
+}
+
+} // namespace kxh
@@ -0,0 +1,152 @@
+/*
+ * Scatter-gather encoding and decoding.
+ *
+ * Network code holds a message as a chain of buffers, as in writev() and
+ * readv(), rather than as one contiguous string. The overloads below take
+ * such a chain of byte buffers directly, so the message need not be copied
+ * into a contiguous string first:
+ *
+ *   ConstBuffer in[] = {{header, header_size}, {body, body_size}};
+ *   BinaryBlob blob = encode<char>(in, 2);
+ *
+ *   MutableBuffer out[] = {{a, a_size}, {b, b_size}};
+ *   std::size_t n = decode<char>(blob, out, 2);
+ *
+ * Every buffer is processed with the contiguous byte paths: the histogram
+ * kernel when counting, the byte and pair lookups when encoding. The bit
+ * sequence carries the state of the encoder from one buffer to the next, so
+ * the output is the same blob as encode() of the concatenated buffers.
+ */
+
+#pragma once
+
+#include "huffman.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <memory_resource>
+#include <optional>
+#include <stdexcept>
+
+namespace kxh
+{
+
+/// A contiguous buffer of bytes to read, as in a struct iovec.
+struct ConstBuffer
+{
+    const void* data;
+    std::size_t size;
+};
+
+/// A contiguous buffer of bytes to write.
+struct MutableBuffer
+{
+    void* data;
+    std::size_t size;
+};
+
+/// Return the total size of the buffers.
+template <class buffer_t>
+std::size_t total_size (const buffer_t* buffers, std::size_t count)
+{
+    std::size_t n = 0;
+    for (std::size_t i = 0; i < count; ++i)
+        n += buffers[i].size;
+    return n;
+}
+
+/// Compute the frequency map of the bytes of the 'count' buffers.
+template <class T>
+FrequencyMap<T> compute_frequencies (const ConstBuffer* buffers, std::size_t count,
+                                     std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    static_assert(sizeof(T) == 1, "buffers hold byte symbols");
+    U64 counts[256] = {};
+    const Kernels& k = kernels();
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        // the kernel counts fewer than 2^32 bytes at a time
+        const U8* data = (const U8*) buffers[i].data;
+        for (std::size_t o = 0; o < buffers[i].size; o += std::size_t(1) << 30)
+            k.histogram(data + o, std::min(buffers[i].size - o, std::size_t(1) << 30), counts);
+    }
+    FrequencyMap<T> freqs(mr);
+    for (std::size_t b = 0; b < 256; ++b)
+        if (counts[b] > 0)
+            freqs[(T) (U8) b] = counts[b];
+    return freqs;
+}
+
+/// Encode the bytes of the 'count' buffers, in order, using Huffman encoding.
+/// The result is identical to encode() of the concatenated buffers.
+/// If 'stats' is not null, it receives the memory used by every stage.
+template <class T>
+BinaryBlob encode (const ConstBuffer* buffers, std::size_t count, MemoryStats* stats = nullptr,
+                   std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    static_assert(sizeof(T) == 1, "buffers hold byte symbols");
+    // with stats, the stages allocate through a meter, as in encode()
+    std::optional<StageMeter> meter;
+    if (stats)
+        meter.emplace(mr);
+    std::pmr::memory_resource* work = meter ? &*meter : mr;
+
+    HuffmanTree<T> t = [&] {
+        FrequencyMap<T> freqs = compute_frequencies<T>(buffers, count, work);
+        if (meter) meter->end_stage(stats->frequencies);
+        return HuffmanTree<T>(freqs, work);
+    }();
+    if (meter) meter->end_stage(stats->tree);
+    Table<T> table = t.make_table();
+    if (meter) meter->end_stage(stats->table);
+    const std::size_t num_symbols = total_size(buffers, count);
+
+    Bitseq code(work);
+    {
+        const ByteEncoder<T> encoder(table, num_symbols);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            const T* data = (const T*) buffers[i].data;
+            encoder.push(data, data + buffers[i].size, code);
+        }
+    }
+    if (meter) meter->end_stage(stats->code);
+
+    BinaryBlob blob = serialise<T>(table, num_symbols, code, nullptr, mr,
+                                   meter ? &*meter : nullptr);
+    if (meter) meter->end_stage(stats->output);
+    return blob;
+}
+
+/// Decode the binary blob into the 'count' buffers, filling each before the
+/// next.
+/// Return the number of decoded bytes.
+/// Throw std::length_error if the buffers are too small; see decoded_size().
+template <class T>
+std::size_t decode (const BinaryBlob& blob, const MutableBuffer* buffers, std::size_t count,
+                    std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    static_assert(sizeof(T) == 1, "buffers hold byte symbols");
+    Table<T> table(mr);
+    std::size_t K;
+    const U8* ptr = (const U8*) blob.c_str();
+    U8 F = deserialise_header(ptr, table, K);
+    if (K > total_size(buffers, count))
+        throw std::length_error("output buffers too small");
+    const DecodeTable<T> codes(table, F & hef_lsb, mr);
+    std::size_t M = deserialise_payload_size(ptr);
+
+    // one bit position across the buffers
+    std::size_t pos = 0;
+    std::size_t left = K;
+    for (std::size_t i = 0; i < count && left > 0; ++i)
+    {
+        std::size_t n = std::min(left, buffers[i].size);
+        codes.decode(ptr, M, pos, n, (T*) buffers[i].data);
+        left -= n;
+    }
+    return K;
+}
+
+} // namespace kxh
@@ -0,0 +1,196 @@
+/*
+ * Decode table cache.
+ *
+ * Blobs from the same producer, such as the blocks of a BlockEncoder stream,
+ * often carry byte-identical tables. decode() rebuilds the table and its
+ * DecodeTable from the header of every blob; a DecodeCache keeps the decode
+ * tables it has built, keyed by the bytes of the serialised table (the
+ * alphabet, lengths and alphabit arrays) and the bit order, so that decoding
+ * a blob with a known table only pays for the payload.
+ *
+ * Entries are looked up by a hash of the table bytes, then compared byte for
+ * byte, so a hash collision is only a miss. The cache holds at most
+ * 'capacity' decode tables and evicts the least recently used one. Decode
+ * tables are immutable and shared: an evicted one lives on until the
+ * decoders using it are done.
+ *
+ * A cache may be shared between threads; lookups are serialised by a mutex,
+ * but decode tables are built and used outside of it. Its memory resource must then
+ * be thread-safe. shared_decode_cache() returns a process-wide cache per
+ * symbol type, allocated with new and delete.
+ */
+
+#pragma once
+
+#include "huffman.h"
+#include "common.h"
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+
+namespace kxh
+{
+
+/// Default number of decode tables held by a DecodeCache.
+const std::size_t decode_cache_capacity = 64;
+
+/// A bounded, thread-safe cache of the decode tables built from serialised
+/// tables.
+template <class T>
+class DecodeCache
+{
+public:
+
+    using table_ptr = std::shared_ptr<const DecodeTable<T>>;
+
+    explicit DecodeCache (std::size_t capacity = decode_cache_capacity,
+                          std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+        : capacity_(capacity), mr(mr), entries(mr), lookup(mr), num_hits(0), num_misses(0) {}
+
+    DecodeCache (const DecodeCache&) = delete;
+    DecodeCache& operator= (const DecodeCache&) = delete;
+
+    /// Return the decode table of the serialised table at 'ptr' for data
+    /// bits in the given order, building it on a miss.
+    /// Advance the pointer to the element past the table.
+    table_ptr find (const U8*& ptr, bool lsb)
+    {
+        const U8* begin = ptr;
+        skip_arrays<T>(ptr);
+        std::string_view key((const char*) begin, ptr - begin);
+        std::size_t hash = std::hash<std::string_view>()(key) ^ (std::size_t) lsb;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = lookup.find(hash);
+            if (it != lookup.end() && it->second->key == key && it->second->lsb == lsb)
+            {
+                entries.splice(entries.begin(), entries, it->second);
+                num_hits++;
+                return it->second->codes;
+            }
+            num_misses++;
+        }
+
+        const U8* arrays = begin;
+        std::pmr::vector<T> alphabet(mr);
+        std::pmr::vector<U8> lengths(mr);
+        Bitseq alphabits(mr);
+        deserialise_arrays(arrays, alphabet, lengths, alphabits);
+        Table<T> table = make_table(alphabet, lengths, alphabits);
+        table_ptr codes = std::allocate_shared<DecodeTable<T>>(
+            std::pmr::polymorphic_allocator<DecodeTable<T>>(mr), table, lsb, mr);
+
+        if (capacity_ > 0)
+            insert(hash, key, lsb, codes);
+        return codes;
+    }
+
+    /// Return the number of lookups that found their decode table.
+    std::size_t hits () const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return num_hits;
+    }
+
+    /// Return the number of lookups that built their decode table.
+    std::size_t misses () const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return num_misses;
+    }
+
+    /// Return the number of decode tables held.
+    std::size_t size () const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+    std::size_t capacity () const {
+        return capacity_;
+    }
+
+    /// Drop all the decode tables and reset the counters.
+    void clear ()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        lookup.clear();
+        entries.clear();
+        num_hits = 0;
+        num_misses = 0;
+    }
+
+private:
+
+    struct Entry
+    {
+        std::size_t hash;
+        std::pmr::string key; // the serialised table
+        bool lsb;             // the bit order
+        table_ptr codes;
+    };
+
+    using entry_list = std::pmr::list<Entry>;
+
+    /// Insert the decode table as the most recently used entry, evicting the
+    /// least recently used one if the cache is full.
+    /// An entry with the same hash, built concurrently or colliding, is
+    /// replaced.
+    void insert (std::size_t hash, std::string_view key, bool lsb, const table_ptr& codes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = lookup.find(hash);
+        if (it != lookup.end())
+        {
+            entries.erase(it->second);
+            lookup.erase(it);
+        }
+        else if (entries.size() == capacity_)
+        {
+            lookup.erase(entries.back().hash);
+            entries.pop_back();
+        }
+        entries.push_front(Entry{hash, std::pmr::string(key, mr), lsb, codes});
+        lookup[hash] = entries.begin();
+    }
+
+    std::size_t capacity_;
+    std::pmr::memory_resource* mr;
+
+    mutable std::mutex mutex;
+    entry_list entries; // most recently used first
+    std::pmr::unordered_map<std::size_t, typename entry_list::iterator> lookup;
+    std::size_t num_hits;
+    std::size_t num_misses;
+};
+
+/// Return the process-wide decode cache for symbols of type T.
+template <class T>
+DecodeCache<T>& shared_decode_cache ()
+{
+    static DecodeCache<T> cache(decode_cache_capacity, std::pmr::new_delete_resource());
+    return cache;
+}
+
+/// Decode the binary blob, taking its decode table from the cache.
+/// The decoded symbols are appended to the container, which is resized once.
+template <class T, class cont_t>
+void decode (const BinaryBlob& blob, cont_t& cont, DecodeCache<T>& cache)
+{
+    const U8* ptr = (const U8*) blob.c_str();
+    U8 F = *ptr++;
+    check_plain(F);
+    typename DecodeCache<T>::table_ptr codes = cache.find(ptr, F & hef_lsb);
+    std::size_t K = deserialise_num(ptr);
+    if (F & hef_indexed)
+        deserialise_index(ptr, K, nullptr);
+
+    std::size_t offset = cont.size();
+    cont.resize(offset + K);
+    decode_payload(ptr, F, *codes, K, cont.begin() + offset);
+}
+
+} // namespace kxh
@@ -9,12 +9,18 @@
  *
  * We produce the following file:
  *
+ * [F: U8]        // flags, see hef_flags
  * ; Huffman tree
  * [N: num]
  * [x0, x1, ..., xN]
  * [L0, L1, ..., LN]
  * [s0s1...sN]
  * ; Encoded data
+ * [K: num]       // number of encoded symbols
+ * ; Seek index, only if F has hef_indexed set
+ * [G: num]       // granularity: number of symbols between index entries
+ * [I1, ..., IE: U64] // Ii = bit offset in B of symbol i*G, E = (K-1)/G
+ * ; Encoded data bits
  * [M_bytes: num] // number of whole bytes, M/8
  * {M_bits: U8]   // number of remaining bits, M%8
  * [b0b1...bM]
@@ -39,6 +45,28 @@
  *     65536 becomes 02 00 01 00 00
  *
  * - L0, L1, ..., LN are the lengths of the bit sequences s0, s1, ..., sN
+ *
+ * - the seek index lets a decoder start decoding at any multiple of G
+ *   symbols without decoding the bits before it
+ *
+ * - the data bits b0b1...bM are packed most significant bit first, unless F
+ *   has hef_lsb set, in which case bit bi is bit i%8 of byte i/8, counting
+ *   from the least significant bit. Little-endian machines can then read and
+ *   write the data bits a whole word at a time. The Huffman tree is always
+ *   packed most significant bit first.
+ *
+ * - if F has hef_bucketed set, the symbols are the buckets of integer
+ *   values (see bucket.h), stored as U8, and every code in B is followed by
+ *   the extra bits of its bucket. Such files are decoded by
+ *   decode_bucketed() only.
+ *
+ * - if F has hef_planes set, the file holds the byte planes of wider
+ *   symbols, each a HEF file of bytes or raw bytes, in the layout described
+ *   in planes.h, and is decoded by decode_planes() only.
+ *
+ * - if F has hef_runs set, the file holds runs of equal symbols as Huffman
+ *   coded (symbol, length) tokens, in the layout described in rle.h, and is
+ *   decoded by decode_runs() only.
  */
 
 #pragma once
@@ -58,6 +86,15 @@ enum num_type
     num_qword = 3
 };
 
+enum hef_flags
+{
+    hef_indexed  = 1 << 0, // the file has a seek index
+    hef_lsb      = 1 << 1, // data bits are packed least significant bit first
+    hef_bucketed = 1 << 2, // symbols are buckets followed by extra bits
+    hef_planes   = 1 << 3, // the file holds byte planes, see planes.h
+    hef_runs     = 1 << 4  // the file holds run-length tokens, see rle.h
+};
+
 #ifdef ALGORITHM_OUTPUT
 #include <cstdio>
 #define DEBUG_PRINT printf
@@ -0,0 +1,337 @@
+/*
+ * Runtime CPU dispatch.
+ *
+ * The library is built for a generic target, but the same binary runs on
+ * hosts with and without BMI2 and AVX2. The hot loops that work on whole
+ * buffers are compiled three times from the same source, for the generic
+ * target, for BMI2 (single-uop variable shifts and bit extraction in the bit
+ * writers and table decoder) and for AVX2 with BMI2 (which also byte-swaps
+ * and stores four blocks at a time), and reached through a table of
+ * function pointers:
+ *
+ *   histogram         byte histogram, for compute_frequencies()
+ *   encode_bytes      MSB-first code writer, for encode() on bytes
+ *   encode_bytes_lsb  LSB-first code writer, for encode_lsb() on bytes
+ *   store_blocks      bit sequence to bytes, for serialise_bitseq()
+ *   decode_codes      flat table decoder, for DecodeTable and DecodeImage,
+ *                     which decode() and the other plain decoders use
+ *
+ * kernels() returns the best table the host supports, detected once with
+ * cpuid on first use. Every table produces the same output. Compilers other
+ * than GCC and Clang on x86, or KXH_NO_DISPATCH, get the generic table only.
+ */
+
+#pragma once
+
+#include "BitStream.h"
+#include "Bitseq.h"
+#include "common.h"
+
+#include <atomic>
+#include <cstddef>
+#include <stdexcept>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(KXH_NO_DISPATCH)
+#define KXH_DISPATCH 1
+#define KXH_TARGET(features) __attribute__((target(features)))
+#define KXH_ALWAYS_INLINE inline __attribute__((always_inline))
+#include <immintrin.h>
+#else
+#define KXH_DISPATCH 0
+#define KXH_TARGET(features)
+#define KXH_ALWAYS_INLINE inline
+#endif
+
+namespace kxh
+{
+
+/// Instruction set levels, each including the previous ones.
+enum cpu_level
+{
+    cpu_baseline,
+    cpu_bmi2,
+    cpu_avx2
+};
+
+/// An entry of a flat decode table: the symbol whose code starts a value of
+/// the table's bits.
+struct DecodeEntry
+{
+    U32 index;  // index of the symbol
+    U32 length; // length of its code, decode_long_code if longer than the table
+};
+
+const U32 decode_long_code = ~U32(0);
+
+/// Default number of bits looked up at once by a DecodeTable.
+const unsigned decode_table_bits = 10;
+
+/// Kernels for an instruction set level.
+struct Kernels
+{
+    const char* name;
+
+    /// Add the histogram of the 'n' bytes, n < 2^32, to 'counts', which has
+    /// 256 entries.
+    void (*histogram) (const U8* data, std::size_t n, U64* counts);
+
+    /// Append the codes of the 'n' bytes, indexed by the unsigned byte, to
+    /// the bit sequence. If 'pairs' is not null, look up two bytes at a time
+    /// in it, and one at a time where its entry is 0; see ByteEncoder.
+    void (*encode_bytes) (const U8* data, std::size_t n, const Code* codes,
+                          const U32* pairs, Bitseq& seq);
+
+    /// Write the LSB-first codes of the 'n' bytes, indexed by the unsigned
+    /// byte.
+    void (*encode_bytes_lsb) (const U8* data, std::size_t n, const LsbCode* codes,
+                              LsbBitWriter& writer);
+
+    /// Store the first 'num_bits' bits of the blocks, most significant bit
+    /// first, to (num_bits+7)/8 bytes.
+    void (*store_blocks) (const Block* blocks, std::size_t num_bits, U8* out);
+
+    /// Decode up to 'count' codes from bit 'pos' of the 'num_bits' data bits
+    /// with the table of 2^bits entries, into the symbol indices 'out'.
+    /// The data bits are LSB-first if 'lsb' is true, MSB-first otherwise.
+    /// Stop early at a code longer than the table, or near the end of the
+    /// data, which must then be decoded otherwise.
+    /// Advance 'pos' past the decoded codes; return their number.
+    std::size_t (*decode_codes) (const U8* data, std::size_t num_bits, std::size_t& pos,
+                                 std::size_t count, const DecodeEntry* table,
+                                 unsigned bits, bool lsb, U32* out);
+};
+
+// The bodies of the kernels, inlined into every variant.
+
+KXH_ALWAYS_INLINE void histogram_body (const U8* data, std::size_t n, U64* counts)
+{
+    // four tables break the dependency between equal consecutive bytes
+    U32 c[4][256] = {};
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        c[0][data[i]]++;
+        c[1][data[i+1]]++;
+        c[2][data[i+2]]++;
+        c[3][data[i+3]]++;
+    }
+    for (; i < n; ++i)
+        c[0][data[i]]++;
+    for (std::size_t b = 0; b < 256; ++b)
+        counts[b] += (U64) c[0][b] + c[1][b] + c[2][b] + c[3][b];
+}
+
+/// Append the right-aligned code of 'length' bits to the 'fill' pending bits
+/// 'acc', moving the pending bits to the bit sequence first if it does not
+/// fit.
+KXH_ALWAYS_INLINE void put_code (Block& acc, unsigned& fill, Block bits, unsigned length,
+                                 Bitseq& seq)
+{
+    if (fill + length > (unsigned) bpp)
+    {
+        seq.push_bits(acc, fill);
+        acc = 0;
+        fill = 0;
+    }
+    acc = length == (unsigned) bpp ? bits : acc << length | bits;
+    fill += length;
+}
+
+KXH_ALWAYS_INLINE void encode_bytes_body (const U8* data, std::size_t n, const Code* codes,
+                                          const U32* pairs, Bitseq& seq)
+{
+    // the codes are gathered in a word, which is pushed when full
+    Block acc = 0;
+    unsigned fill = 0;
+    std::size_t i = 0;
+    if (pairs)
+    {
+        for (; i + 2 <= n; i += 2)
+        {
+            U32 p = pairs[(std::size_t) data[i] << 8 | data[i+1]];
+            if (p)
+                put_code(acc, fill, p >> 8, p & 0xFF, seq);
+            else
+            {
+                put_code(acc, fill, codes[data[i]].bits, codes[data[i]].length, seq);
+                put_code(acc, fill, codes[data[i+1]].bits, codes[data[i+1]].length, seq);
+            }
+        }
+    }
+    for (; i < n; ++i)
+        put_code(acc, fill, codes[data[i]].bits, codes[data[i]].length, seq);
+    if (fill > 0)
+        seq.push_bits(acc, fill);
+}
+
+KXH_ALWAYS_INLINE void encode_bytes_lsb_body (const U8* data, std::size_t n,
+                                              const LsbCode* codes, LsbBitWriter& writer)
+{
+    for (std::size_t i = 0; i < n; ++i)
+        write_lsb_code(writer, codes[data[i]]);
+}
+
+KXH_ALWAYS_INLINE void store_blocks_body (const Block* blocks, std::size_t num_bits, U8* out)
+{
+    const std::size_t whole = num_bits / bpp;
+    for (std::size_t i = 0; i < whole; ++i)
+        store_be64(out + i*sizeof(Block), blocks[i]);
+    const std::size_t rest = (num_bits % bpp + 7) / 8;
+    for (std::size_t j = 0; j < rest; ++j)
+        out[whole*sizeof(Block) + j] = (U8) (blocks[whole] >> (bpp - 8 - 8*j));
+}
+
+#if KXH_DISPATCH
+KXH_TARGET("avx2") KXH_ALWAYS_INLINE
+void store_blocks_avx2_body (const Block* blocks, std::size_t num_bits, U8* out)
+{
+    // reverse the bytes of every 64-bit lane, four blocks at a time
+    const __m256i swap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                          7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const std::size_t whole = num_bits / bpp;
+    std::size_t i = 0;
+    for (; i + 4 <= whole; i += 4)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (blocks + i));
+        _mm256_storeu_si256((__m256i*) (out + i*sizeof(Block)), _mm256_shuffle_epi8(v, swap));
+    }
+    // the remaining whole blocks and the partial one
+    store_blocks_body(blocks + i, num_bits - i*bpp, out + i*sizeof(Block));
+}
+#endif
+
+template <bool lsb>
+KXH_ALWAYS_INLINE std::size_t decode_codes_body (const U8* data, std::size_t num_bits,
+                                                 std::size_t& pos, std::size_t count,
+                                                 const DecodeEntry* table, unsigned bits,
+                                                 U32* out)
+{
+    // a word is loaded only if it ends before the last, possibly partial, byte
+    const std::size_t num_bytes = (num_bits+7)/8;
+    const U64 mask = (U64(1) << bits) - 1;
+    std::size_t n = 0;
+    while (n < count)
+    {
+        std::size_t byte = pos >> 3;
+        if (bits == 0 || byte + 9 > num_bytes)
+            break;
+        std::size_t shift = pos & 7;
+        U64 buf = lsb ? load_le64(data + byte) >> shift
+                      : load_be64(data + byte) << shift;
+        std::size_t avail = 64 - shift;
+        while (n < count && avail >= bits)
+        {
+            const DecodeEntry e = table[lsb ? buf & mask : buf >> (64 - bits)];
+            if (e.length == decode_long_code)
+                return n;
+            buf = lsb ? buf >> e.length : buf << e.length;
+            avail -= e.length;
+            pos += e.length;
+            out[n++] = e.index;
+        }
+    }
+    return n;
+}
+
+#define KXH_DEFINE_KERNELS(ns, target, store_body) \
+namespace ns \
+{ \
+target inline void histogram (const U8* data, std::size_t n, U64* counts) { \
+    histogram_body(data, n, counts); \
+} \
+target inline void encode_bytes (const U8* data, std::size_t n, const Code* codes, \
+                                 const U32* pairs, Bitseq& seq) { \
+    encode_bytes_body(data, n, codes, pairs, seq); \
+} \
+target inline void encode_bytes_lsb (const U8* data, std::size_t n, const LsbCode* codes, \
+                                     LsbBitWriter& writer) { \
+    encode_bytes_lsb_body(data, n, codes, writer); \
+} \
+target inline void store_blocks (const Block* blocks, std::size_t num_bits, U8* out) { \
+    store_body(blocks, num_bits, out); \
+} \
+target inline std::size_t decode_codes (const U8* data, std::size_t num_bits, std::size_t& pos, \
+                                        std::size_t count, const DecodeEntry* table, \
+                                        unsigned bits, bool lsb, U32* out) { \
+    return lsb ? decode_codes_body<true>(data, num_bits, pos, count, table, bits, out) \
+               : decode_codes_body<false>(data, num_bits, pos, count, table, bits, out); \
+} \
+}
+
+KXH_DEFINE_KERNELS(baseline_kernels, , store_blocks_body)
+#if KXH_DISPATCH
+KXH_DEFINE_KERNELS(bmi2_kernels, KXH_TARGET("bmi,bmi2"), store_blocks_body)
+KXH_DEFINE_KERNELS(avx2_kernels, KXH_TARGET("avx2,bmi,bmi2"), store_blocks_avx2_body)
+#endif
+
+/// Return the highest instruction set level supported by the host.
+inline cpu_level detect_cpu_level ()
+{
+#if KXH_DISPATCH
+    __builtin_cpu_init();
+    bool bmi2 = __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2");
+    if (bmi2 && __builtin_cpu_supports("avx2")) return cpu_avx2;
+    if (bmi2) return cpu_bmi2;
+#endif
+    return cpu_baseline;
+}
+
+/// Return the kernels of the instruction set level.
+/// Throw std::invalid_argument if the host does not support the level.
+inline const Kernels& kernel_table (cpu_level level)
+{
+    static const Kernels baseline = {
+        "baseline",
+        baseline_kernels::histogram, baseline_kernels::encode_bytes,
+        baseline_kernels::encode_bytes_lsb,
+        baseline_kernels::store_blocks, baseline_kernels::decode_codes
+    };
+#if KXH_DISPATCH
+    static const Kernels bmi2 = {
+        "bmi2",
+        bmi2_kernels::histogram, bmi2_kernels::encode_bytes,
+        bmi2_kernels::encode_bytes_lsb,
+        bmi2_kernels::store_blocks, bmi2_kernels::decode_codes
+    };
+    static const Kernels avx2 = {
+        "avx2",
+        avx2_kernels::histogram, avx2_kernels::encode_bytes,
+        avx2_kernels::encode_bytes_lsb,
+        avx2_kernels::store_blocks, avx2_kernels::decode_codes
+    };
+#endif
+    static const cpu_level supported = detect_cpu_level();
+    if (level > supported)
+        throw std::invalid_argument("instruction set not supported by the host");
+    switch (level)
+    {
+#if KXH_DISPATCH
+    case cpu_avx2: return avx2;
+    case cpu_bmi2: return bmi2;
+#endif
+    default: return baseline;
+    }
+}
+
+/// The selected kernels.
+inline std::atomic<const Kernels*>& active_kernels ()
+{
+    static std::atomic<const Kernels*> active(&kernel_table(detect_cpu_level()));
+    return active;
+}
+
+/// Return the kernels selected for the host.
+inline const Kernels& kernels ()
+{
+    return *active_kernels().load(std::memory_order_relaxed);
+}
+
+/// Select the kernels of a lower instruction set level, to test or compare
+/// them.
+/// Throw std::invalid_argument if the host does not support the level.
+inline void select_kernels (cpu_level level)
+{
+    active_kernels().store(&kernel_table(level), std::memory_order_relaxed);
+}
+
+} // namespace kxh
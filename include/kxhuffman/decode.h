@@ -1,16 +1,25 @@
 #pragma once
 
 #include "HuffmanTree.h"
+#include "StaticCode.h"
+#include "BitStream.h"
+#include "cpu.h"
+#include "memory.h"
 #include "common.h"
 
 #include <vector>
 #include <string>
+#include <cstring>
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+#include <unordered_map>
 
 namespace kxh
 {
 
 /// Perform a memory copy and advance the source pointer.
-void read (U8* dst, const U8*& src, std::size_t num_bytes)
+inline void read (U8* dst, const U8*& src, std::size_t num_bytes)
 {
     memcpy(dst, src, num_bytes);
     src += num_bytes;
@@ -18,7 +27,7 @@ void read (U8* dst, const U8*& src, std::size_t num_bytes)
 
 /// Deserialise the number.
 /// Advance the pointer to the element past the serialised number.
-std::size_t deserialise_num (const U8*& ptr)
+inline std::size_t deserialise_num (const U8*& ptr)
 {
     num_type nt = (num_type) *ptr++;
     switch (nt)
@@ -71,9 +80,9 @@ void deserialise_byte (U8 c, std::size_t n, cont_t& seq)
 /// If 'size' is 0, the number of bits in the bit sequence is decoded from the blob.
 /// Advance the pointer past the serialised sequence.
 /// Return the number of bits in the resulting bit sequence.
-std::size_t deserialise_bitseq (const U8*& ptr,
-                                Bitseq& seq,
-                                std::size_t size = 0)
+inline std::size_t deserialise_bitseq (const U8*& ptr,
+                                       Bitseq& seq,
+                                       std::size_t size = 0)
 {
     // read the number of bits in the bit sequence if necessary
     std::size_t M;
@@ -99,16 +108,17 @@ std::size_t deserialise_bitseq (const U8*& ptr,
 
 /// Convert the alphabet, encoding bits and length arrays into a Huffman table.
 template <class T>
-Table<T> make_table (const std::vector<T>& alphabet,
-                     const std::vector<U8>& lengths,
+Table<T> make_table (const std::pmr::vector<T>& alphabet,
+                     const std::pmr::vector<U8>& lengths,
                      const Bitseq& alphabits)
 {
-    Table<T> table;
+    std::pmr::memory_resource* mr = alphabet.get_allocator().resource();
+    Table<T> table(mr);
     std::size_t o = 0;
     for (std::size_t i = 0; i < alphabet.size(); ++i)
     {
         // lengths[i] = length of this bitseq
-        Bitseq bits;
+        Bitseq bits(mr);
         for (U8 j = 0; j < lengths[i]; ++j)
             bits.push_bit(alphabits[o+j]);
         table[alphabet[i]] = bits;
@@ -121,8 +131,8 @@ Table<T> make_table (const std::vector<T>& alphabet,
 /// Advance the pointer to the element past the data.
 template <class T>
 void deserialise_arrays (const U8*& ptr,
-                         std::vector<T>& alphabet,
-                         std::vector<U8>& lengths,
+                         std::pmr::vector<T>& alphabet,
+                         std::pmr::vector<U8>& lengths,
                          Bitseq& alphabits)
 {
     // read the number of elements in the alphabet
@@ -144,8 +154,10 @@ void deserialise_arrays (const U8*& ptr,
     for (U8 L : lengths)
         M += L;
 
-    // read the alphabits sequence
-    deserialise_bitseq(ptr, alphabits, M);
+    // read the alphabits sequence.
+    // M is 0 when the alphabet has a single element, whose code is empty.
+    if (M > 0)
+        deserialise_bitseq(ptr, alphabits, M);
 
 #ifdef ALGORITHM_OUTPUT
     printf("N: %u\n", N);
@@ -167,16 +179,103 @@ void deserialise_arrays (const U8*& ptr,
 #endif
 }
 
-/// Deserialise the blob into a Huffman table and a bit sequence.
+/// Skip the serialised alphabet, lengths and alphabit arrays.
+/// Advance the pointer to the element past the data.
+template <class T>
+void skip_arrays (const U8*& ptr)
+{
+    std::size_t N = deserialise_num(ptr);
+    ptr += N * sizeof(T);
+    std::size_t M = 0;
+    for (std::size_t i = 0; i < N; ++i)
+        M += *ptr++;
+    ptr += (M+7)/8;
+}
+
+/// Return the size of the serialised alphabet, lengths and alphabit arrays
+/// at 'ptr', reading at most 'size' bytes.
+/// Throw std::runtime_error if the arrays do not fit in 'size' bytes.
 template <class T>
-void deserialise (const U8*& ptr, Table<T>& table, Bitseq& code)
+std::size_t checked_arrays_size (const U8* ptr, std::size_t size)
+{
+    const U8* const begin = ptr;
+    auto check = [&] (std::size_t n) {
+        if (n > size - (std::size_t) (ptr - begin))
+            throw std::runtime_error("truncated table");
+    };
+    static const std::size_t num_sizes[] = { 1, 2, 4, 8 };
+    check(1);
+    if (*ptr > num_qword)
+        throw std::runtime_error("invalid number type");
+    check(1 + num_sizes[*ptr]);
+    std::size_t N = deserialise_num(ptr);
+    if (N > (size - (std::size_t) (ptr - begin)) / (sizeof(T) + 1))
+        throw std::runtime_error("truncated table");
+    ptr += N * sizeof(T);
+    std::size_t M = 0;
+    for (std::size_t i = 0; i < N; ++i)
+        M += *ptr++;
+    check((M+7)/8);
+    return ptr - begin + (M+7)/8;
+}
+
+/// Deserialise the seek index of a sequence of 'num_symbols' symbols.
+/// If 'index' is not null, it is pointed at the entries in place; nothing is
+/// copied.
+/// Advance the pointer past the index.
+inline void deserialise_index (const U8*& ptr, std::size_t num_symbols, SeekIndexView* index)
 {
-    std::vector<T> alphabet;
-    std::vector<U8> lengths;
-    Bitseq alphabits;
+    std::size_t G = deserialise_num(ptr);
+    if (G == 0)
+        throw std::runtime_error("invalid seek index");
+    std::size_t E = num_symbols == 0 ? 0 : (num_symbols-1) / G;
+    if (index)
+        *index = SeekIndexView{G, E, ptr};
+    ptr += sizeof(U64) * E;
+}
+
+/// Throw std::runtime_error if the flags call for a decoder other than the
+/// plain Huffman decoders.
+inline void check_plain (U8 flags)
+{
+    if (flags & hef_bucketed)
+        throw std::runtime_error("bucketed blob, decode it with decode_bucketed()");
+    if (flags & hef_planes)
+        throw std::runtime_error("byte plane blob, decode it with decode_planes()");
+    if (flags & hef_runs)
+        throw std::runtime_error("run-length blob, decode it with decode_runs()");
+}
+
+/// Deserialise the blob's header: the Huffman table, the number of encoded
+/// symbols and, if present and 'index' is not null, the seek index.
+/// Advance the pointer to the encoded data.
+/// Return the flags.
+template <class T>
+U8 deserialise_header (const U8*& ptr, Table<T>& table, std::size_t& num_symbols,
+                       SeekIndexView* index = nullptr)
+{
+    std::pmr::memory_resource* mr = table.get_allocator().resource();
+    U8 F = *ptr++;
+    check_plain(F);
+    std::pmr::vector<T> alphabet(mr);
+    std::pmr::vector<U8> lengths(mr);
+    Bitseq alphabits(mr);
     deserialise_arrays(ptr, alphabet, lengths, alphabits);
-    deserialise_bitseq(ptr, code);
+    num_symbols = deserialise_num(ptr);
+    if (F & hef_indexed)
+        deserialise_index(ptr, num_symbols, index);
     table = make_table(alphabet, lengths, alphabits);
+    return F;
+}
+
+/// Deserialise the blob into a Huffman table, the number of encoded symbols
+/// and a bit sequence.
+template <class T>
+void deserialise (const U8*& ptr, Table<T>& table, std::size_t& num_symbols,
+                  Bitseq& code)
+{
+    deserialise_header(ptr, table, num_symbols);
+    deserialise_bitseq(ptr, code);
 #ifdef ALGORITHM_OUTPUT
     printf("Alphabet encoding:\n");
     for (const auto& keyval : table)
@@ -196,23 +295,360 @@ void deserialise (const U8*& ptr, Table<T>& table, Bitseq& code)
 #endif
 }
 
-/// Decode the sequence using the given Huffman table.
-template <class T, class iter_t, class cont_t>
-void decode_seq (const iter_t& begin, const iter_t& end,
-                 const Table<T>& table, cont_t& cont)
+/// Decode 'count' symbols of the sequence into 'out' using the given Huffman
+/// table.
+template <class T, class iter_t, class out_iter_t>
+out_iter_t decode_seq (const iter_t& begin, const iter_t& end,
+                       const Table<T>& table, std::size_t count, out_iter_t out)
 {
     HuffmanTree<T> tree(table);
-    tree.decode(begin, end, cont);
+    return tree.decode(begin, end, count, out);
+}
+
+/// Deserialise the number of bits of the encoded data.
+/// Advance the pointer to the data bits.
+inline std::size_t deserialise_payload_size (const U8*& ptr)
+{
+    std::size_t M_bytes = deserialise_num(ptr);
+    U8 M_bits = *ptr++;
+    return M_bytes*8 + M_bits;
+}
+
+/// Flat lookup table of the codes of a Huffman table.
+template <class T>
+class DecodeTable
+{
+public:
+
+    /// Build the lookup table of the codes for data bits stored least
+    /// significant bit first if 'lsb' is true, most significant bit first
+    /// otherwise.
+    DecodeTable (const Table<T>& table, bool lsb,
+                 std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+        : lsb_(lsb), bits(0), symbols(mr), indices(mr), entries(mr), tree(table, mr)
+    {
+        for (const auto& keyval : table)
+        {
+            indices[keyval.first] = (U32) symbols.size();
+            symbols.push_back(keyval.first);
+            bits = std::max<unsigned>(bits, (unsigned) keyval.second.size());
+        }
+        bits = std::min(bits, decode_table_bits);
+
+        entries.assign(std::size_t(1) << bits, DecodeEntry{0, decode_long_code});
+        for (const auto& keyval : table)
+        {
+            const Bitseq& code = keyval.second;
+            std::size_t L = code.size();
+            if (L > bits) continue;
+            std::size_t prefix = 0;
+            for (std::size_t j = 0; j < L; ++j)
+                if (code[j])
+                    prefix |= std::size_t(1) << (lsb_ ? j : bits-1-j);
+            // every value of the remaining bits
+            DecodeEntry e{indices[keyval.first], (U32) L};
+            for (std::size_t r = 0; r < (std::size_t(1) << (bits-L)); ++r)
+                entries[lsb_ ? prefix | r << L : prefix | r] = e;
+        }
+    }
+
+    /// Return the number of symbols.
+    std::size_t size () const {
+        return symbols.size();
+    }
+
+    /// Return the symbol of the given index.
+    const T& symbol (std::size_t i) const {
+        return symbols[i];
+    }
+
+    /// Return true if the table decodes LSB-first data bits.
+    bool lsb () const {
+        return lsb_;
+    }
+
+    /// Return the index of the symbol, or size() if it has no code.
+    std::size_t index_of (const T& x) const {
+        auto it = indices.find(x);
+        return it == indices.end() ? size() : it->second;
+    }
+
+    /// Decode the symbol at bit 'pos' of the 'num_bits' data bits, and
+    /// advance 'pos' past its code.
+    /// Return the index of the symbol.
+    std::size_t next (const U8* data, std::size_t num_bits, std::size_t& pos) const
+    {
+        const DecodeEntry& e = entries[peek(data, num_bits, pos)];
+        if (e.length != decode_long_code && pos + e.length <= num_bits)
+        {
+            pos += e.length;
+            return e.index;
+        }
+        return next_long(data, num_bits, pos);
+    }
+
+    /// Decode 'count' symbols from bit 'pos' of the 'num_bits' data bits,
+    /// and call 'visit' with the index of every one until it returns false.
+    /// Advance 'pos' past the last decoded code, if 'visit' did not stop the
+    /// scan.
+    /// Return false if 'visit' stopped the scan.
+    template <class visit_t>
+    bool scan (const U8* data, std::size_t num_bits, std::size_t& pos,
+               std::size_t count, visit_t&& visit) const
+    {
+        // decode a batch of codes with the table, then visit them
+        const Kernels& k = kernels();
+        U32 batch[256];
+        while (count > 0)
+        {
+            std::size_t n = k.decode_codes(data, num_bits, pos, std::min<std::size_t>(count, 256),
+                                           entries.data(), bits, lsb_, batch);
+            for (std::size_t i = 0; i < n; ++i)
+                if (!visit(batch[i])) return false;
+            count -= n;
+            if (n == 0) // a long code, or the end of the data
+            {
+                count--;
+                if (!visit(next(data, num_bits, pos))) return false;
+            }
+        }
+        return true;
+    }
+
+    /// Decode 'count' symbols from bit 'pos' of the 'num_bits' data bits
+    /// into 'out', and advance 'pos' past their codes.
+    /// Return the output iterator past the last decoded symbol.
+    template <class out_iter_t>
+    out_iter_t decode (const U8* data, std::size_t num_bits, std::size_t& pos,
+                       std::size_t count, out_iter_t out) const
+    {
+        if (symbols.size() == 1) // a single symbol, with an empty code
+        {
+            for (; count > 0; --count, ++out)
+                *out = symbols[0];
+            return out;
+        }
+        if (symbols.empty() && count > 0)
+            throw std::runtime_error("invalid code in bit sequence");
+        scan(data, num_bits, pos, count, [&] (std::size_t i) {
+            *out = symbols[i];
+            ++out;
+            return true;
+        });
+        return out;
+    }
+
+private:
+
+    /// Return the next 'bits' bits at bit 'pos', padded with zeros past the
+    /// end of the data.
+    std::size_t peek (const U8* data, std::size_t num_bits, std::size_t pos) const
+    {
+        if (bits == 0) return 0;
+        std::size_t byte = pos >> 3;
+        std::size_t shift = pos & 7;
+        std::size_t num_bytes = (num_bits+7)/8;
+        U64 word = 0;
+        if (byte + 8 <= num_bytes)
+            word = lsb_ ? load_le64(data + byte) : load_be64(data + byte);
+        else // tail of the data
+        {
+            for (std::size_t n = 0; byte + n < num_bytes; ++n)
+                word |= lsb_ ? (U64) data[byte+n] << (8*n) : (U64) data[byte+n] << (56 - 8*n);
+        }
+        if (lsb_)
+            return (word >> shift) & ((std::size_t(1) << bits) - 1);
+        else
+            return (word << shift) >> (64 - bits);
+    }
+
+    /// Decode a symbol whose code is longer than the table, or runs past
+    /// the end of the data, down the tree.
+    std::size_t next_long (const U8* data, std::size_t num_bits, std::size_t& pos) const
+    {
+        const T* x;
+        if (lsb_)
+        {
+            LsbBitIterator it(data, num_bits, pos);
+            x = &tree.decode_symbol(it, LsbBitIterator(data, num_bits, num_bits));
+            pos = it.position();
+        }
+        else
+        {
+            BitIterator it(data, pos);
+            x = &tree.decode_symbol(it, BitIterator(data, num_bits));
+            pos = it.position();
+        }
+        return indices.find(*x)->second;
+    }
+
+    bool lsb_;
+    unsigned bits;
+    std::pmr::vector<T> symbols;
+    std::pmr::unordered_map<T, U32> indices;
+    std::pmr::vector<DecodeEntry> entries;
+    HuffmanTree<T> tree;
+};
+
+/// Decode 'count' symbols of the encoded data at 'ptr' into 'out' with the
+/// table's lookups, starting at bit 'offset' of the data bits.
+/// The data bits are read in place.
+/// Throw std::invalid_argument if the flags and the table have different
+/// bit orders.
+template <class T, class out_iter_t>
+out_iter_t decode_payload (const U8* ptr, U8 flags, const DecodeTable<T>& table,
+                           std::size_t count, out_iter_t out, std::size_t offset = 0)
+{
+    std::size_t M = deserialise_payload_size(ptr);
+    if (offset > M)
+        throw std::runtime_error("invalid bit offset");
+    if (bool(flags & hef_lsb) != table.lsb())
+        throw std::invalid_argument("blob and decode table have different bit orders");
+    return table.decode(ptr, M, offset, count, out);
 }
 
 template <class T, class cont_t>
-void decode (const BinaryBlob& blob, cont_t& cont)
+void decode (const BinaryBlob& blob, cont_t& cont, MemoryStats* stats,
+             std::pmr::memory_resource* mr)
+{
+    // with stats, the stages allocate through a meter; the container does
+    // not come from 'mr', so its growth is counted on the meter
+    std::optional<StageMeter> meter;
+    if (stats)
+    {
+        *stats = MemoryStats();
+        meter.emplace(mr);
+    }
+    std::pmr::memory_resource* work = meter ? &*meter : mr;
+
+    Table<T> table(work);
+    std::size_t K;
+    const U8* ptr = (const U8*) blob.c_str();
+    U8 F = deserialise_header(ptr, table, K);
+    if (meter) meter->end_stage(stats->table);
+    const DecodeTable<T> codes(table, F & hef_lsb, work);
+    if (meter) meter->end_stage(stats->tree);
+
+    // grow the output once, then decode in place
+    std::size_t offset = cont.size();
+    std::size_t cont_bytes = container_bytes(cont);
+    cont.resize(offset + K);
+    if (meter) meter->count_outside(container_bytes(cont) - cont_bytes);
+    decode_payload(ptr, F, codes, K, cont.begin() + offset);
+    if (meter) meter->end_stage(stats->output);
+}
+
+template <class T>
+std::size_t decode (const BinaryBlob& blob, T* out, std::size_t capacity,
+                    std::pmr::memory_resource* mr)
+{
+    Table<T> table(mr);
+    std::size_t K;
+    const U8* ptr = (const U8*) blob.c_str();
+    U8 F = deserialise_header(ptr, table, K);
+
+    if (K > capacity)
+        throw std::length_error("output buffer too small");
+    const DecodeTable<T> codes(table, F & hef_lsb, mr);
+    decode_payload(ptr, F, codes, K, out);
+    return K;
+}
+
+template <class T>
+std::size_t decoded_size (const BinaryBlob& blob, std::pmr::memory_resource* mr)
 {
-    Table<T> table;
-    Bitseq code;
     const U8* ptr = (const U8*) blob.c_str();
-    deserialise(ptr, table, code);
-    decode_seq(code.begin(), code.end(), table, cont);
+    check_plain(*ptr++);
+    std::pmr::vector<T> alphabet(mr);
+    std::pmr::vector<U8> lengths(mr);
+    Bitseq alphabits(mr);
+    deserialise_arrays(ptr, alphabet, lengths, alphabits);
+    return deserialise_num(ptr);
+}
+
+/// Output iterator adaptor that drops the first 'skip' values written.
+template <class out_iter_t>
+class skip_iterator
+{
+public:
+
+    skip_iterator (out_iter_t out, std::size_t skip)
+        : out(out), skip(skip) {}
+
+    skip_iterator& operator* () { return *this; }
+    skip_iterator& operator++ () { return *this; }
+
+    template <class T>
+    skip_iterator& operator= (const T& x) {
+        if (skip > 0) skip--;
+        else { *out = x; ++out; }
+        return *this;
+    }
+
+    out_iter_t base () const { return out; }
+
+private:
+
+    out_iter_t out;
+    std::size_t skip;
+};
+
+/// Find the closest indexed symbol at or before symbol 'first'.
+/// Set 'start' to its position in the sequence.
+/// Return its bit offset in the data bits; only that entry is read.
+inline std::size_t seek (const SeekIndexView& index, std::size_t first, std::size_t& start)
+{
+    start = 0;
+    if (index.granularity == 0 || first < index.granularity)
+        return 0;
+    std::size_t e = first / index.granularity;
+    start = e * index.granularity;
+    return index[e-1];
+}
+
+template <class T, class out_iter_t>
+out_iter_t decode_range (const BinaryBlob& blob, std::size_t first, std::size_t count,
+                         out_iter_t out, std::pmr::memory_resource* mr)
+{
+    Table<T> table(mr);
+    std::size_t K;
+    SeekIndexView index;
+    const U8* ptr = (const U8*) blob.c_str();
+    U8 F = deserialise_header(ptr, table, K, &index);
+    if (first > K || count > K - first)
+        throw std::out_of_range("symbol range out of bounds");
+    if (count == 0)
+        return out;
+
+    std::size_t start;
+    std::size_t offset = seek(index, first, start);
+
+    const DecodeTable<T> codes(table, F & hef_lsb, mr);
+    skip_iterator<out_iter_t> skip(out, first - start);
+    skip = decode_payload(ptr, F, codes, first - start + count, skip, offset);
+    return skip.base();
+}
+
+template <class T, std::size_t N, class cont_t>
+void decode (const StaticCode<N>& code, const BinaryBlob& blob, cont_t& cont)
+{
+    Bitseq seq;
+    const U8* ptr = (const U8*) blob.c_str();
+    std::size_t M = deserialise_bitseq(ptr, seq);
+
+    std::size_t i = 0;
+    bool overrun = false;
+    auto next_bit = [&]() {
+        if (i == M) { overrun = true; return false; }
+        return seq[i++];
+    };
+    while (i < M)
+    {
+        std::size_t x = code.decode_symbol(next_bit);
+        if (x == N || overrun)
+            throw std::runtime_error("invalid static code sequence");
+        cont.push_back((T) x);
+    }
 }
 
 } // namespace kxh
@@ -1,28 +1,39 @@
 #pragma once
 
 #include "HuffmanTree.h"
+#include "StaticCode.h"
+#include "BitStream.h"
+#include "cpu.h"
+#include "memory.h"
 #include "common.h"
 
 #include <vector>
 #include <string>
 #include <cstring>
+#include <unordered_map>
+#include <type_traits>
+#include <iterator>
+#include <stdexcept>
+#include <algorithm>
+#include <optional>
 
 namespace kxh
 {
 
 /// Perform a memory copy and advance the destination pointer.
-void write (U8*& dst, const void* src, std::size_t num_bytes)
+inline void write (U8*& dst, const void* src, std::size_t num_bytes)
 {
     memcpy(dst, src, num_bytes);
     dst += num_bytes;
 }
 
 /// Serialise the number.
-BinaryBlob serialise_num (std::size_t val)
+inline BinaryBlob serialise_num (std::size_t val,
+                                 std::pmr::memory_resource* mr = std::pmr::get_default_resource())
 {
     if (val <= 255)
     {
-        BinaryBlob buf(1+1,0);
+        BinaryBlob buf(1+1, 0, mr);
         buf[0] = num_byte;
         buf[1] = (U8) val;
         return buf;
@@ -30,7 +41,7 @@ BinaryBlob serialise_num (std::size_t val)
     else if (val <= 65535)
     {
         U16 val16 = (U16) val;
-        BinaryBlob buf(1+2,0);
+        BinaryBlob buf(1+2, 0, mr);
         buf[0] = num_word;
         memcpy(&buf[1], &val16, sizeof(U16));
         return buf;
@@ -38,7 +49,7 @@ BinaryBlob serialise_num (std::size_t val)
     else if (val <= 4294967295)
     {
         U32 val32 = (U32) val;
-        BinaryBlob buf(1+4,0);
+        BinaryBlob buf(1+4, 0, mr);
         buf[0] = num_dword;
         memcpy(&buf[1], &val32, sizeof(U32));
         return buf;
@@ -46,7 +57,7 @@ BinaryBlob serialise_num (std::size_t val)
     else
     {
         U64 val64 = (U64) val;
-        BinaryBlob buf(1+8,0);
+        BinaryBlob buf(1+8, 0, mr);
         buf[0] = num_qword;
         memcpy(&buf[1], &val64, sizeof(U64));
         return buf;
@@ -61,7 +72,7 @@ struct encode_seq
     static Bitseq encode (iter_t begin, const iter_t& end, const Table<T>& table)
     {
         DEBUG_PRINT("Code sequence encoding:\n");
-        Bitseq seq;
+        Bitseq seq(table.get_allocator());
         for (; begin != end; ++begin)
         {
             auto it = table.find(*begin);
@@ -79,38 +90,187 @@ struct encode_seq
     }
 };
 
+/// Convert the bit sequence into a right-aligned code.
+inline Code make_code (const Bitseq& seq)
+{
+    if (seq.size() > (std::size_t) bpp)
+        throw std::length_error("code too long");
+    Code c;
+    for (std::size_t i = 0; i < seq.size(); ++i)
+        c.bits = (c.bits << 1) | (Block) seq[i];
+    c.length = (U8) seq.size();
+    return c;
+}
+
+/// Map symbols to right-aligned codes.
+template <class T, int N = sizeof(T)>
+struct CodeLookup
+{
+    explicit CodeLookup (const Table<T>& table)
+        : codes(table.get_allocator().resource()) {
+        for (const auto& keyval : table)
+            codes[keyval.first] = make_code(keyval.second);
+    }
+
+    const Code& operator() (const T& x) const {
+        auto it = codes.find(x);
+        DEBUG_ASSERT(it != codes.end());
+        return it->second;
+    }
+
+    std::pmr::unordered_map<T,Code> codes;
+};
+
+// specialise for T s.t. sizeof(T) = 1
+template <class T>
+struct CodeLookup<T, 1>
+{
+    explicit CodeLookup (const Table<T>& table) {
+        for (const auto& keyval : table)
+            codes[(U8) keyval.first] = make_code(keyval.second);
+    }
+
+    const Code& operator() (const T& x) const {
+        return codes[(U8) x];
+    }
+
+    Code codes[256];
+};
+
+/// Append the codes of byte symbols to a bit sequence, one contiguous
+/// segment of the input at a time.
+template <class T>
+class ByteEncoder
+{
+public:
+
+    /// Prepare the lookups of the table for 'num_symbols' symbols in total.
+    ByteEncoder (const Table<T>& table, std::size_t num_symbols)
+        : long_codes(false), value_seq(table.get_allocator()),
+          pairs(table.get_allocator().resource())
+    {
+        for (const auto& keyval : table)
+            long_codes |= keyval.second.size() > (std::size_t) bpp;
+        if (long_codes)
+        {
+            // codes too long for a word; index by the unsigned byte, since T
+            // may be a signed char
+            value_seq.resize(256);
+            for (const auto& keyval : table)
+                value_seq[(U8) keyval.first] = keyval.second;
+            return;
+        }
+        codes.emplace(table);
+        if (use_pairs(table, num_symbols))
+        {
+            // the concatenated codes of every pair of bytes, followed by
+            // their length in the low byte; 0 for the escapes, whose codes
+            // are too long
+            pairs.resize(65536);
+            for (std::size_t a = 0; a < 256; ++a)
+            {
+                const Code& ca = codes->codes[a];
+                for (std::size_t b = 0; b < 256; ++b)
+                {
+                    const Code& cb = codes->codes[b];
+                    std::size_t length = ca.length + cb.length;
+                    if (length > pair_table_max_length)
+                        continue;
+                    U32 bits = (U32) (ca.bits << cb.length | cb.bits);
+                    pairs[a << 8 | b] = bits << 8 | (U32) length;
+                }
+            }
+        }
+    }
+
+    /// Return true if encoding 'num_symbols' symbols with the table looks
+    /// up the codes of two bytes at a time.
+    static bool use_pairs (const Table<T>& table, std::size_t num_symbols)
+    {
+        if (num_symbols < pair_table_min_symbols)
+            return false;
+        for (const auto& keyval : table)
+            if (keyval.second.size() == 0 || keyval.second.size() > (std::size_t) bpp)
+                return false;
+        return true;
+    }
+
+    /// Append the codes of the segment to the bit sequence.
+    template <class iter_t>
+    void push (iter_t begin, const iter_t& end, Bitseq& seq) const
+    {
+        if (long_codes)
+        {
+            for (; begin != end; ++begin)
+                seq.push_seq(value_seq[(U8) *begin]);
+            return;
+        }
+        // encode the bytes in place if they are contiguous, a buffer at a
+        // time otherwise
+        const Kernels& k = kernels();
+        const U32* pair_codes = pairs.empty() ? nullptr : pairs.data();
+        if constexpr (std::is_pointer<iter_t>::value)
+        {
+            k.encode_bytes((const U8*) begin, end - begin, codes->codes, pair_codes, seq);
+        }
+        else
+        {
+            using category = typename std::iterator_traits<iter_t>::iterator_category;
+            U8 buf[4096];
+            while (begin != end)
+            {
+                std::size_t n = 0;
+                if constexpr (std::is_base_of<std::random_access_iterator_tag, category>::value)
+                {
+                    n = std::min<std::size_t>(sizeof(buf), end - begin);
+                    std::copy_n(begin, n, buf);
+                    begin += n;
+                }
+                else
+                {
+                    for (; n < sizeof(buf) && begin != end; ++begin)
+                        buf[n++] = (U8) *begin;
+                }
+                k.encode_bytes(buf, n, codes->codes, pair_codes, seq);
+            }
+        }
+    }
+
+private:
+
+    bool long_codes;                    // whether a code is longer than a block
+    std::pmr::vector<Bitseq> value_seq; // codes by byte, if long_codes
+    std::optional<CodeLookup<T>> codes; // codes by byte, unless long_codes
+    std::pmr::vector<U32> pairs;        // codes by pair of bytes, if used
+};
+
 // specialise for T s.t. sizeof(T) = 1
 template <class T, class iter_t>
 struct encode_seq<T, iter_t, 1>
 {
+    /// Return true if encoding 'num_symbols' symbols with the table looks
+    /// up the codes of two bytes at a time.
+    static bool use_pairs (const Table<T>& table, std::size_t num_symbols) {
+        return ByteEncoder<T>::use_pairs(table, num_symbols);
+    }
+
     static Bitseq encode (iter_t begin, const iter_t& end, const Table<T>& table)
     {
-        // transform table to vector for faster lookups
-        std::vector<Bitseq> value_seq(256);
-        for (const auto& keyval : table)
-            value_seq[keyval.first] = keyval.second;
-        // encode
-        Bitseq seq;
-        for (; begin != end; ++begin)
-            seq.push_seq(value_seq[*begin]);
+        Bitseq seq(table.get_allocator());
+        ByteEncoder<T>(table, std::distance(begin, end)).push(begin, end, seq);
         return seq;
     }
 };
 
-/// Rotate the byte 1 bit to the right.
-inline U8 rotate_right (U8 c)
-{
-    return (c >> 1) | ((c & 1) << 7);
-}
-
 /// Serialise the bit sequence.
 /// If write_num = false, then the number of bits in the bit sequence is not
 /// included in the blob.
-BinaryBlob serialise_bitseq (const Bitseq& bitseq, bool write_num = true)
+inline BinaryBlob serialise_bitseq (const Bitseq& bitseq, bool write_num = true)
 {
     const std::size_t n = bitseq.size();
+    std::pmr::memory_resource* mr = bitseq.get_allocator().resource();
 
-    std::string M_bytes = write_num ? serialise_num(n/8) : std::string();
+    BinaryBlob M_bytes = write_num ? serialise_num(n/8, mr) : BinaryBlob(mr);
     U8 M_bits  = write_num ? n%8 : 0;
 
     std::size_t buf_size
@@ -123,7 +283,7 @@ BinaryBlob serialise_bitseq (const Bitseq& bitseq, bool write_num = true)
         buf_size += 1; // M_bits
     }
 
-    std::string data(buf_size,0);
+    BinaryBlob data(buf_size, 0, mr);
     U8* ptr = (U8*) data.c_str();
 
     // write the number of bits in the bit sequence
@@ -133,15 +293,8 @@ BinaryBlob serialise_bitseq (const Bitseq& bitseq, bool write_num = true)
         write(ptr, &M_bits, 1);
     }
 
-    // write the bit sequence
-    // start with 10000000
-    // then rotate the mask to the right to write the next bit in the sequence
-    U8 mask = 0x80;
-    for (size_t i = 0; i < n; ++i)
-    {
-        ptr[i >> 3] |= (mask * (U8) bitseq[i]);
-        mask = rotate_right(mask);
-    }
+    // write the bit sequence a block at a time
+    kernels().store_blocks(bitseq.data(), n, ptr);
 
     return data;
 }
@@ -149,8 +302,8 @@ BinaryBlob serialise_bitseq (const Bitseq& bitseq, bool write_num = true)
 /// Convert the Huffman table into alphabet, encoding bits and length arrays.
 template <class T>
 void make_arrays (const Table<T>& table,
-                  std::vector<T>& alphabet,
-                  std::vector<U8>& lengths,
+                  std::pmr::vector<T>& alphabet,
+                  std::pmr::vector<U8>& lengths,
                   Bitseq& alphabits)
 {
     for (const auto& keyval : table)
@@ -175,15 +328,17 @@ void make_arrays (const Table<T>& table,
 
 /// Serialise the alphabet, alphabet bit sequence, and length arrays.
 template <class T>
-BinaryBlob serialise_arrays (const std::vector<T>& alphabet,
-                             const std::vector<U8>& lengths,
+BinaryBlob serialise_arrays (const std::pmr::vector<T>& alphabet,
+                             const std::pmr::vector<U8>& lengths,
                              const Bitseq& alphabits)
 {
+    std::pmr::memory_resource* mr = alphabet.get_allocator().resource();
+
     // do not include the number of bits in the serialised alphabits.
     // the lengths vector is enough to decode the alphabits.
     BinaryBlob serial_alphabits = serialise_bitseq(alphabits, false);
 
-    std::string N = serialise_num(alphabet.size());
+    BinaryBlob N = serialise_num(alphabet.size(), mr);
 
     size_t buf_size
             = N.size() // number of alphabet elements
@@ -191,7 +346,7 @@ BinaryBlob serialise_arrays (const std::vector<T>& alphabet,
             + lengths.size() // alphabet bit sequence lengths
             + serial_alphabits.size(); // alphabet bit sequences
 
-    std::string buf(buf_size,0);
+    BinaryBlob buf(buf_size, 0, mr);
     U8* ptr = (U8*) buf.c_str();
 
     write(ptr, &N[0], N.size());
@@ -224,24 +379,65 @@ BinaryBlob serialise_arrays (const std::vector<T>& alphabet,
     return buf;
 }
 
-/// Serialise the Huffman table and bit sequence.
+/// Serialise the seek index.
+inline BinaryBlob serialise_index (const SeekIndex& index,
+                                   std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    BinaryBlob G = serialise_num(index.granularity, mr);
+    BinaryBlob buf(G.size() + sizeof(U64) * index.offsets.size(), 0, mr);
+    U8* ptr = (U8*) buf.c_str();
+    write(ptr, &G[0], G.size());
+    if (!index.offsets.empty())
+        write(ptr, &index.offsets[0], sizeof(U64) * index.offsets.size());
+    return buf;
+}
+
+/// Serialise the flags, the Huffman table, the number of encoded symbols and
+/// the optional seek index.
 template <class T>
-BinaryBlob serialise (const Table<T>& table, const Bitseq& code)
+BinaryBlob serialise_header (const Table<T>& table, std::size_t num_symbols,
+                             U8 flags, const SeekIndex* index = nullptr)
 {
-    Bitseq alphabits;
-    std::vector<T> alphabet;
-    std::vector<U8> lengths;
+    std::pmr::memory_resource* mr = table.get_allocator().resource();
+    Bitseq alphabits(mr);
+    std::pmr::vector<T> alphabet(mr);
+    std::pmr::vector<U8> lengths(mr);
     make_arrays(table, alphabet, lengths, alphabits);
 
+    U8 F = flags | (index ? hef_indexed : 0);
     BinaryBlob serial_tree = serialise_arrays(alphabet, lengths, alphabits);
-    BinaryBlob serial_code = serialise_bitseq(code);
+    BinaryBlob K = serialise_num(num_symbols, mr);
+    BinaryBlob serial_index = index ? serialise_index(*index, mr) : BinaryBlob(mr);
 
-    std::size_t s = serial_tree.size() + serial_code.size();
-    std::string buf(s, 0);
+    std::size_t s = 1 + serial_tree.size() + K.size() + serial_index.size();
+    BinaryBlob buf(s, 0, mr);
     U8* ptr = (U8*) buf.c_str();
 
+    write(ptr, &F, 1);
     write(ptr, &serial_tree[0], serial_tree.size());
-    write(ptr, &serial_code[0], serial_code.size());
+    write(ptr, &K[0], K.size());
+    write(ptr, serial_index.data(), serial_index.size());
+
+    return buf;
+}
+
+/// Serialise the Huffman table, the number of encoded symbols, the optional
+/// seek index and the bit sequence.
+/// The blob is allocated from 'mr', or from the table's resource if null.
+/// If 'meter' is not null, the blob is counted in its current stage.
+template <class T>
+BinaryBlob serialise (const Table<T>& table, std::size_t num_symbols,
+                      const Bitseq& code, const SeekIndex* index = nullptr,
+                      std::pmr::memory_resource* mr = nullptr, StageMeter* meter = nullptr)
+{
+    BinaryBlob header = serialise_header(table, num_symbols, 0, index);
+    BinaryBlob payload = serialise_bitseq(code);
+    BinaryBlob buf(mr ? mr : table.get_allocator().resource());
+    buf.reserve(header.size() + payload.size());
+    if (meter)
+        meter->count_outside(container_bytes(buf));
+    buf += header;
+    buf += payload;
 
 #ifdef ALGORITHM_OUTPUT
     printf("M: %u\n", code.size());
@@ -256,12 +452,167 @@ BinaryBlob serialise (const Table<T>& table, const Bitseq& code)
 }
 
 template <class T, class iter_t>
-BinaryBlob encode (iter_t begin, const iter_t& end)
+BinaryBlob encode (iter_t begin, const iter_t& end, MemoryStats* stats,
+                   std::pmr::memory_resource* mr)
 {
-    HuffmanTree<T> t(begin, end);
+    // with stats, the stages allocate through a meter; the blob outlives
+    // it, so it comes from 'mr' directly
+    std::optional<StageMeter> meter;
+    if (stats)
+        meter.emplace(mr);
+    std::pmr::memory_resource* work = meter ? &*meter : mr;
+
+    HuffmanTree<T> t = [&] {
+        FrequencyMap<T> freqs = compute_frequencies<T>(begin, end, work);
+        if (meter) meter->end_stage(stats->frequencies);
+        return HuffmanTree<T>(freqs, work);
+    }();
+    if (meter) meter->end_stage(stats->tree);
     Table<T> table = t.make_table();
+    if (meter) meter->end_stage(stats->table);
     Bitseq code = encode_seq<T,iter_t>::encode(begin, end, table);
-    return serialise<T>(table, code);
+    if (meter) meter->end_stage(stats->code);
+    std::size_t num_symbols = std::distance(begin, end);
+    BinaryBlob blob = serialise<T>(table, num_symbols, code, nullptr, mr,
+                                   meter ? &*meter : nullptr);
+    if (meter) meter->end_stage(stats->output);
+    return blob;
+}
+
+/// Encode the sequence using the given Huffman table, recording the bit
+/// offset of every symbol whose position is a multiple of the index's
+/// granularity.
+template <class T, class iter_t>
+Bitseq encode_seq_indexed (iter_t begin, const iter_t& end, const Table<T>& table,
+                           SeekIndex& index)
+{
+    Bitseq seq(table.get_allocator());
+    std::size_t next = index.granularity;
+    for (std::size_t i = 0; begin != end; ++begin, ++i)
+    {
+        if (i == next)
+        {
+            index.offsets.push_back(seq.size());
+            next += index.granularity;
+        }
+        auto it = table.find(*begin);
+        DEBUG_ASSERT(it != table.end());
+        seq.push_seq(it->second);
+    }
+    return seq;
+}
+
+template <class T, class iter_t>
+BinaryBlob encode_indexed (iter_t begin, const iter_t& end, std::size_t granularity,
+                           std::pmr::memory_resource* mr)
+{
+    if (granularity == 0)
+        throw std::invalid_argument("index granularity must be positive");
+    HuffmanTree<T> t(begin, end, mr);
+    Table<T> table = t.make_table();
+    SeekIndex index{granularity, std::pmr::vector<U64>(mr)};
+    Bitseq code = encode_seq_indexed<T>(begin, end, table, index);
+    std::size_t num_symbols = std::distance(begin, end);
+    return serialise<T>(table, num_symbols, code, &index);
+}
+
+/// Reverse the code into LSB-first order.
+inline LsbCode make_lsb_code (const Bitseq& code)
+{
+    if (code.size() > 64)
+        throw std::length_error("code too long for LSB-first packing");
+    LsbCode c;
+    for (std::size_t i = 0; i < code.size(); ++i)
+        c.bits |= (U64) code[i] << i;
+    c.length = (U8) code.size();
+    return c;
+}
+
+/// Encode the sequence LSB-first using the given Huffman table.
+template <class T, class iter_t, int N = sizeof(T)>
+struct encode_seq_lsb
+{
+    static void encode (iter_t begin, const iter_t& end, const Table<T>& table,
+                        LsbBitWriter& writer)
+    {
+        std::pmr::unordered_map<T,LsbCode> codes(table.get_allocator().resource());
+        for (const auto& keyval : table)
+            codes[keyval.first] = make_lsb_code(keyval.second);
+        for (; begin != end; ++begin)
+        {
+            auto it = codes.find(*begin);
+            DEBUG_ASSERT(it != codes.end());
+            write_lsb_code(writer, it->second);
+        }
+    }
+};
+
+// specialise for T s.t. sizeof(T) = 1
+template <class T, class iter_t>
+struct encode_seq_lsb<T, iter_t, 1>
+{
+    static void encode (iter_t begin, const iter_t& end, const Table<T>& table,
+                        LsbBitWriter& writer)
+    {
+        LsbCode codes[256];
+        for (const auto& keyval : table)
+            codes[(U8) keyval.first] = make_lsb_code(keyval.second);
+        // encode the bytes a buffer at a time
+        U8 buf[4096];
+        while (begin != end)
+        {
+            std::size_t n = 0;
+            for (; n < sizeof(buf) && begin != end; ++begin)
+                buf[n++] = (U8) *begin;
+            kernels().encode_bytes_lsb(buf, n, codes, writer);
+        }
+    }
+};
+
+/// Encode the sequence using Huffman encoding, with the data bits packed
+/// least significant bit first.
+/// All the memory used by the call, including the returned blob, is
+/// allocated from 'mr'.
+template <class T, class iter_t>
+BinaryBlob encode_lsb (iter_t begin, const iter_t& end,
+                       std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    HuffmanTree<T> t(begin, end, mr);
+    Table<T> table = t.make_table();
+
+    BinaryBlob bits(table.get_allocator());
+    LsbBitWriter writer(bits);
+    encode_seq_lsb<T,iter_t>::encode(begin, end, table, writer);
+    std::size_t M = writer.flush();
+
+    std::size_t num_symbols = std::distance(begin, end);
+    BinaryBlob buf = serialise_header(table, num_symbols, hef_lsb);
+    buf += serialise_num(M/8, mr);
+    buf += (char) (M%8);
+    buf += bits;
+    return buf;
+}
+
+/// Return the index of the symbol in a static code's alphabet.
+template <class T>
+std::size_t static_symbol (const T& x)
+{
+    static_assert(std::is_integral<T>::value, "static codes require integral symbols");
+    return (std::size_t) (typename std::make_unsigned<T>::type) x;
+}
+
+template <std::size_t N, class iter_t>
+BinaryBlob encode (const StaticCode<N>& code, iter_t begin, const iter_t& end)
+{
+    Bitseq seq;
+    for (; begin != end; ++begin)
+    {
+        std::size_t x = static_symbol(*begin);
+        if (x >= N || code.length(x) == 0)
+            throw std::invalid_argument("symbol has no code in the static code");
+        seq.push_bits(code.code(x), code.length(x));
+    }
+    return serialise_bitseq(seq);
 }
 
 } // namespace kxh
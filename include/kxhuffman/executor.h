@@ -0,0 +1,307 @@
+/*
+ * Executors.
+ *
+ * The parallel entry points of the library (encode_parallel(),
+ * decode_parallel()) do not start threads of their own: they run their work
+ * on an Executor, so that a program can route it onto the scheduler it
+ * already has instead of oversubscribing the cores. An executor runs
+ * submitted tasks, and runs parallel loops over [0, n):
+ *
+ *   ThreadPool      a work-stealing pool, the default
+ *   InlineExecutor  runs everything on the calling thread
+ *
+ * Programs plug in their own scheduler by deriving from Executor and
+ * implementing submit() and concurrency(). The default parallel_for() is
+ * built on submit() and is safe to call from a task of the same executor:
+ * the calling thread takes part in the loop and only waits for iterations
+ * that other threads have already started, so a loop never waits on tasks
+ * stuck in a queue behind it.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kxh
+{
+
+/// Runs tasks, possibly concurrently.
+class Executor
+{
+public:
+
+    using Task = std::function<void()>;
+
+    virtual ~Executor () {}
+
+    /// Submit a task, which runs at some later point, possibly on another
+    /// thread, or before the call returns.
+    /// Tasks must not throw.
+    virtual void submit (Task task) = 0;
+
+    /// Return the number of tasks that may run at once.
+    virtual std::size_t concurrency () const = 0;
+
+    /// Call f(i) for every i in [0, n), concurrently, and return when all
+    /// the calls have returned.
+    /// If calls throw, the first exception is rethrown once all the calls
+    /// have returned.
+    virtual void parallel_for (std::size_t n, const std::function<void(std::size_t)>& f)
+    {
+        const std::size_t helpers = std::min(n, concurrency()) - (n > 0);
+        if (helpers == 0)
+        {
+            for (std::size_t i = 0; i < n; ++i)
+                f(i);
+            return;
+        }
+
+        // the loop state outlives the call for helpers that start late
+        auto loop = std::make_shared<Loop>(n, f);
+        for (std::size_t i = 0; i < helpers; ++i)
+            submit([loop] { loop->run(); });
+        loop->run();
+        loop->wait();
+        if (loop->error)
+            std::rethrow_exception(loop->error);
+    }
+
+private:
+
+    /// The iterations of a parallel_for(), claimed one at a time by the
+    /// calling thread and the helper tasks.
+    struct Loop
+    {
+        Loop (std::size_t n, const std::function<void(std::size_t)>& f)
+            : n(n), f(&f) {}
+
+        /// Run unclaimed iterations until there are none left.
+        void run ()
+        {
+            for (;;)
+            {
+                std::size_t i = next++;
+                if (i >= n)
+                    return;
+                try { (*f)(i); }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error) error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (++finished == n)
+                    done.notify_all();
+            }
+        }
+
+        /// Block until every iteration has finished.
+        void wait ()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this] { return finished == n; });
+        }
+
+        const std::size_t n;
+        const std::function<void(std::size_t)>* f; // valid until all iterations finished
+        std::atomic<std::size_t> next{0};
+        std::mutex mutex;
+        std::condition_variable done;
+        std::size_t finished = 0;
+        std::exception_ptr error;
+    };
+};
+
+/// Runs every task on the calling thread, before submit() returns.
+class InlineExecutor : public Executor
+{
+public:
+
+    void submit (Task task) override {
+        task();
+    }
+
+    std::size_t concurrency () const override {
+        return 1;
+    }
+};
+
+/// A work-stealing thread pool.
+///
+/// Every worker owns a task deque. Tasks submitted from a worker go to the
+/// back of its own deque and are popped LIFO, which keeps related work on the
+/// worker that produced it. Idle workers steal from the front of the other
+/// workers' deques.
+class ThreadPool : public Executor
+{
+public:
+
+    /// Create a pool with the given number of worker threads.
+    /// 0 means one worker per hardware thread.
+    explicit ThreadPool (std::size_t num_threads = 0)
+    {
+        if (num_threads == 0)
+            num_threads = std::thread::hardware_concurrency();
+        if (num_threads == 0)
+            num_threads = 1;
+        for (std::size_t i = 0; i < num_threads; ++i)
+            workers.emplace_back(new Worker);
+        for (std::size_t i = 0; i < num_threads; ++i)
+            threads.emplace_back([this, i] { run(i); });
+    }
+
+    /// Wait for the pending tasks, then stop the workers.
+    ~ThreadPool ()
+    {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& t : threads)
+            t.join();
+    }
+
+    ThreadPool (const ThreadPool&) = delete;
+    ThreadPool& operator= (const ThreadPool&) = delete;
+
+    /// Return the number of worker threads.
+    std::size_t size () const {
+        return workers.size();
+    }
+
+    std::size_t concurrency () const override {
+        return workers.size();
+    }
+
+    void submit (Task task) override
+    {
+        std::size_t w = current_pool == this ? current_worker
+                                             : next_worker++ % workers.size();
+        // count the task first so that 'pending' cannot drop to 0 while
+        // it sits in a deque
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queued++;
+            pending++;
+        }
+        {
+            std::lock_guard<std::mutex> lock(workers[w]->mutex);
+            workers[w]->tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+
+    /// Block until every submitted task, including the tasks submitted by
+    /// running tasks, has finished.
+    void wait ()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return pending == 0; });
+    }
+
+private:
+
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    /// Pop a task from the worker's own deque, or steal one from another.
+    bool pop_task (std::size_t self, Task& task)
+    {
+        {
+            Worker& w = *workers[self];
+            std::lock_guard<std::mutex> lock(w.mutex);
+            if (!w.tasks.empty())
+            {
+                task = std::move(w.tasks.back());
+                w.tasks.pop_back();
+                return true;
+            }
+        }
+        for (std::size_t i = 1; i < workers.size(); ++i)
+        {
+            Worker& w = *workers[(self + i) % workers.size()];
+            std::lock_guard<std::mutex> lock(w.mutex);
+            if (!w.tasks.empty())
+            {
+                task = std::move(w.tasks.front());
+                w.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run (std::size_t self)
+    {
+        current_pool = this;
+        current_worker = self;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || queued > 0; });
+                if (stopping && queued == 0)
+                    return;
+            }
+
+            Task task;
+            if (!pop_task(self, task))
+                continue; // another worker got there first
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queued--;
+            }
+
+            task();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0)
+                done.notify_all();
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable wake; // signalled when tasks are queued
+    std::condition_variable done; // signalled when no task is pending
+    std::size_t queued = 0;       // tasks in the deques
+    std::size_t pending = 0;      // tasks submitted but not finished
+    bool stopping = false;
+
+    std::atomic<std::size_t> next_worker{0}; // target of external submits
+
+    static thread_local ThreadPool* current_pool;
+    static thread_local std::size_t current_worker;
+};
+
+inline thread_local ThreadPool* ThreadPool::current_pool = nullptr;
+inline thread_local std::size_t ThreadPool::current_worker = 0;
+
+/// Return the process-wide pool used by the parallel entry points that are
+/// not given an executor, with one worker per hardware thread. It is created
+/// on first use.
+inline Executor& default_executor ()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+} // namespace kxh
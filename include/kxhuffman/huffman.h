@@ -1,21 +1,122 @@
 #pragma once
 
+#include "StaticCode.h"
+#include "memory.h"
+#include "common.h"
+
+#include <cstring>
+#include <memory_resource>
 #include <string>
+#include <vector>
 
 namespace kxh
 {
 
-using BinaryBlob = std::string;
+/// An encoded sequence, allocated from the memory resource passed to the
+/// encoder.
+using BinaryBlob = std::pmr::string;
+
+/// Bit offsets of every G-th symbol of an encoded sequence, for random access.
+struct SeekIndex
+{
+    std::size_t granularity = 0;   // G, number of symbols between entries
+    std::pmr::vector<U64> offsets; // bit offset of symbol (i+1)*G
+};
+
+/// A seek index read in place from a blob, which must outlive it.
+struct SeekIndexView
+{
+    std::size_t granularity = 0;  // G, or 0 if the blob has no index
+    std::size_t size = 0;         // number of entries
+    const U8* entries = nullptr;  // unaligned U64 bit offsets of symbols (i+1)*G
+
+    /// Return the bit offset of symbol (i+1)*G.
+    U64 operator[] (std::size_t i) const
+    {
+        U64 offset;
+        std::memcpy(&offset, entries + sizeof(U64) * i, sizeof(U64));
+        return offset;
+    }
+};
 
 /// Encode the sequence using Huffman encoding.
+/// If 'stats' is not null, it receives the memory used by every stage; see
+/// memory.h.
+/// All the memory used by the call, including the returned blob, is
+/// allocated from 'mr'.
 template <class T, class iter_t>
-BinaryBlob encode (iter_t begin, const iter_t& end);
+BinaryBlob encode (iter_t begin, const iter_t& end, MemoryStats* stats = nullptr,
+                   std::pmr::memory_resource* mr = std::pmr::get_default_resource());
 
 /// Decode the binary blob using Huffman encoding.
+/// The decoded symbols are appended to the container, which is resized once.
+/// If 'stats' is not null, it receives the memory used by every stage.
+/// The memory used by the call, other than the container's, is allocated
+/// from 'mr'.
 template <class T, class cont_t>
-void decode (const BinaryBlob&, cont_t& cont);
+void decode (const BinaryBlob&, cont_t& cont, MemoryStats* stats = nullptr,
+             std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+/// Decode the binary blob into a caller-provided buffer of 'capacity' symbols.
+/// Return the number of decoded symbols.
+/// Throw if the buffer is too small; see decoded_size().
+template <class T>
+std::size_t decode (const BinaryBlob&, T* out, std::size_t capacity,
+                    std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+/// Return the number of symbols encoded in the binary blob.
+/// The header arrays are read into memory allocated from 'mr'.
+/// Throw std::runtime_error if the blob needs another decoder; see
+/// check_plain().
+template <class T>
+std::size_t decoded_size (const BinaryBlob&,
+                          std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+/// Encode the sequence using Huffman encoding, with a seek index that has an
+/// entry every 'granularity' symbols.
+/// All the memory used by the call, including the returned blob, is
+/// allocated from 'mr'.
+template <class T, class iter_t>
+BinaryBlob encode_indexed (iter_t begin, const iter_t& end, std::size_t granularity,
+                           std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+/// Decode the symbols [first, first+count) of the binary blob into 'out'.
+/// If the blob has a seek index, decoding starts at the closest indexed
+/// symbol; otherwise it starts at the beginning.
+/// Every call parses the header; to decode many ranges of one blob, parse it
+/// once with an EncodedView (query.h) and call its decode_range().
+/// The table and its lookups are allocated from 'mr'; the index is read in
+/// place.
+/// Throw std::out_of_range if the range exceeds the encoded sequence.
+template <class T, class out_iter_t>
+out_iter_t decode_range (const BinaryBlob&, std::size_t first, std::size_t count,
+                         out_iter_t out,
+                         std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+/// Encode the sequence using a static code.
+/// The output holds only the encoded data section of a HEF file.
+/// Throw std::invalid_argument if a symbol has no code.
+template <std::size_t N, class iter_t>
+BinaryBlob encode (const StaticCode<N>& code, iter_t begin, const iter_t& end);
+
+/// Decode the binary blob using a static code.
+template <class T, std::size_t N, class cont_t>
+void decode (const StaticCode<N>& code, const BinaryBlob&, cont_t& cont);
 
 } // namespace kxh
 
 #include "encode.h"
 #include "decode.h"
+#include "adaptive.h"
+#include "sampling.h"
+#include "parallel.h"
+#include "block.h"
+#include "range.h"
+#include "cache.h"
+#include "query.h"
+#include "image.h"
+#include "buffers.h"
+#include "bucket.h"
+#include "planes.h"
+#include "rle.h"
+#include "instances.h"
@@ -0,0 +1,424 @@
+/*
+ * Precompiled decode images.
+ *
+ * A decoder that starts cold with a fixed table pays for parsing the table,
+ * building its tree node by node and, for the table-driven paths, filling a
+ * lookup table, before it decodes the first symbol. A decode image is all of
+ * that done ahead of time and laid out flat, so that a process can map the
+ * image file and decode with it in place, with no parsing and no allocation:
+ *
+ *   BinaryBlob image = build_decode_image<char>(table);   // offline
+ *   ... write the image to a file ...
+ *
+ *   void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+ *   DecodeImage<char> code(p, size);                      // in the worker
+ *   decode(blob, text, code);
+ *
+ * The image is a header followed by 8-byte aligned sections:
+ *
+ *   [header]     magic, version, byte order, sizes, offsets and checksum
+ *   [symbols]    T[N], the alphabet in the order of the serialised table
+ *   [entries]    DecodeEntry[2^bits], the flat lookup table, see query.h
+ *   [nodes]      ImageNode[num_nodes], the tree, for codes longer than the
+ *                lookup table and for the last bits of the data
+ *   [table]      the serialised table, as in the header of a HEF blob
+ *
+ * Fields are stored in the byte order of the host that built the image; an
+ * image is rejected on a host of the other byte order. The checksum is the
+ * 64-bit FNV-1a hash of the sections. Decoding a blob with an image checks
+ * that the blob's serialised table is the image's, byte for byte, so images
+ * should be built from the same Table object as the encoder used, or from a
+ * blob it encoded.
+ */
+
+#pragma once
+
+#include "huffman.h"
+#include "common.h"
+
+#include <cstddef>
+#include <cstring>
+#include <memory_resource>
+#include <stdexcept>
+#include <type_traits>
+
+namespace kxh
+{
+
+/// Version of the decode image format.
+const U32 decode_image_version = 1;
+
+/// Largest number of bits looked up at once by a decode image.
+const unsigned decode_image_max_bits = 20;
+
+/// Header of a decode image.
+struct ImageHeader
+{
+    char magic[8];         // "KXHIMAGE"
+    U32 version;           // decode_image_version
+    U32 byte_order;        // 0x01020304, as stored by the building host
+    U32 symbol_size;       // sizeof(T)
+    U32 flags;             // hef_lsb if the lookup table reads LSB-first data
+    U32 num_symbols;
+    U32 bits;              // bits looked up at once
+    U32 num_nodes;
+    U32 table_size;        // bytes of the serialised table
+    U64 symbols_offset;    // offsets of the sections from the image start
+    U64 entries_offset;
+    U64 nodes_offset;
+    U64 table_offset;
+    U64 size;              // bytes of the image
+    U64 checksum;          // FNV-1a of the bytes [sizeof(ImageHeader), size)
+};
+
+/// An internal node of the tree of a decode image. A child is the index of a
+/// node, image_leaf | the index of a symbol, or 0 if no code goes that way.
+struct ImageNode
+{
+    U32 child[2];
+};
+
+const U32 image_leaf = U32(1) << 31;
+
+const char decode_image_magic[8] = {'K', 'X', 'H', 'I', 'M', 'A', 'G', 'E'};
+const U32 decode_image_byte_order = 0x01020304;
+
+/// Return the 64-bit FNV-1a hash of the bytes.
+inline U64 fnv1a64 (const U8* data, std::size_t n)
+{
+    U64 h = 0xcbf29ce484222325ULL;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        h ^= data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/// Round the offset up to a multiple of 8.
+inline std::size_t align8 (std::size_t offset)
+{
+    return (offset + 7) & ~std::size_t(7);
+}
+
+/// A read-only view of a decode image.
+template <class T>
+class DecodeImage
+{
+public:
+
+    static_assert(std::is_trivially_copyable<T>::value && alignof(T) <= 8,
+                  "decode images hold trivially copyable symbols aligned to at most 8 bytes");
+
+    /// View the image of 'size' bytes at 'data', which must be 8-byte
+    /// aligned and outlive the view.
+    /// If 'verify' is true, check the checksum and that every index in the
+    /// image is in bounds, in O(size); otherwise only check the header.
+    /// Throw std::invalid_argument if the image is misaligned or was built
+    /// for another symbol type or byte order, std::runtime_error if it is
+    /// invalid.
+    DecodeImage (const void* data, std::size_t size, bool verify = true)
+        : base((const U8*) data), header((const ImageHeader*) data)
+    {
+        if ((std::size_t) base % 8 != 0)
+            throw std::invalid_argument("decode image is not 8-byte aligned");
+        if (size < sizeof(ImageHeader) || memcmp(header->magic, decode_image_magic, 8) != 0)
+            throw std::runtime_error("invalid decode image");
+        if (header->byte_order != decode_image_byte_order)
+            throw std::invalid_argument("decode image has another byte order");
+        if (header->symbol_size != sizeof(T))
+            throw std::invalid_argument("decode image has another symbol type");
+        if (header->version != decode_image_version || header->size != size
+            || header->num_symbols == 0 || header->bits > decode_image_max_bits
+            || !in_bounds(header->symbols_offset, header->num_symbols * sizeof(T))
+            || !in_bounds(header->entries_offset, sizeof(DecodeEntry) << header->bits)
+            || !in_bounds(header->nodes_offset, header->num_nodes * sizeof(ImageNode))
+            || !in_bounds(header->table_offset, header->table_size))
+            throw std::runtime_error("invalid decode image");
+
+        symbols = (const T*) (base + header->symbols_offset);
+        entries = (const DecodeEntry*) (base + header->entries_offset);
+        nodes = (const ImageNode*) (base + header->nodes_offset);
+
+        if (verify)
+            check();
+    }
+
+    /// Return the number of symbols.
+    std::size_t size () const {
+        return header->num_symbols;
+    }
+
+    /// Return the symbol of the given index.
+    const T& symbol (std::size_t i) const {
+        return symbols[i];
+    }
+
+    /// Return true if the image decodes LSB-first data bits.
+    bool lsb () const {
+        return header->flags & hef_lsb;
+    }
+
+    /// Return the number of bits looked up at once.
+    unsigned bits () const {
+        return header->bits;
+    }
+
+    /// Return the serialised table the image was built from.
+    const U8* table () const {
+        return base + header->table_offset;
+    }
+
+    std::size_t table_size () const {
+        return header->table_size;
+    }
+
+    /// Decode 'count' symbols from bit 'pos' of the 'num_bits' data bits
+    /// into 'out', and advance 'pos' past their codes.
+    /// Return the output iterator past the last decoded symbol.
+    template <class out_iter_t>
+    out_iter_t decode (const U8* data, std::size_t num_bits, std::size_t& pos,
+                       std::size_t count, out_iter_t out) const
+    {
+        if (header->num_nodes == 0) // a single symbol, with an empty code
+        {
+            for (; count > 0; --count, ++out)
+                *out = symbols[0];
+            return out;
+        }
+
+        const Kernels& k = kernels();
+        const bool lsb = this->lsb();
+        U32 batch[256];
+        while (count > 0)
+        {
+            std::size_t n = k.decode_codes(data, num_bits, pos, std::min<std::size_t>(count, 256),
+                                           entries, header->bits, lsb, batch);
+            for (std::size_t i = 0; i < n; ++i, ++out)
+                *out = symbols[batch[i]];
+            count -= n;
+            if (n == 0) // a long code, or the end of the data
+            {
+                *out = symbols[next_long(data, num_bits, pos)];
+                ++out;
+                count--;
+            }
+        }
+        return out;
+    }
+
+private:
+
+    bool in_bounds (U64 offset, U64 n) const {
+        return offset % 8 == 0 && offset >= sizeof(ImageHeader)
+            && offset <= header->size && n <= header->size - offset;
+    }
+
+    /// Check the checksum and the indices of the lookup table and the tree.
+    void check () const
+    {
+        if (fnv1a64(base + sizeof(ImageHeader), header->size - sizeof(ImageHeader))
+            != header->checksum)
+            throw std::runtime_error("decode image checksum mismatch");
+        for (std::size_t i = 0; i < (std::size_t(1) << header->bits); ++i)
+        {
+            const DecodeEntry& e = entries[i];
+            if (e.length != decode_long_code
+                && (e.length > header->bits || e.index >= header->num_symbols))
+                throw std::runtime_error("invalid decode image");
+        }
+        for (std::size_t i = 0; i < header->num_nodes; ++i)
+            for (U32 c : nodes[i].child)
+                if (c & image_leaf ? (c & ~image_leaf) >= header->num_symbols
+                                   : c >= header->num_nodes)
+                    throw std::runtime_error("invalid decode image");
+    }
+
+    /// Decode a symbol down the tree, a bit at a time, and advance 'pos'
+    /// past its code.
+    /// Return the index of the symbol.
+    std::size_t next_long (const U8* data, std::size_t num_bits, std::size_t& pos) const
+    {
+        const bool lsb = this->lsb();
+        U32 n = 0;
+        for (;;)
+        {
+            if (pos == num_bits)
+                throw std::runtime_error("truncated bit sequence");
+            U8 byte = data[pos >> 3];
+            int bit = lsb ? (byte >> (pos & 7)) & 1 : (byte >> (7 - (pos & 7))) & 1;
+            pos++;
+            U32 c = nodes[n].child[bit];
+            if (c == 0)
+                throw std::runtime_error("invalid code in bit sequence");
+            if (c & image_leaf)
+                return c & ~image_leaf;
+            n = c;
+        }
+    }
+
+    const U8* base;
+    const ImageHeader* header;
+    const T* symbols;
+    const DecodeEntry* entries;
+    const ImageNode* nodes;
+};
+
+/// Build the decode image of the serialised table at 'table', which must fit
+/// in 'table_size' bytes, for data bits stored LSB-first if 'lsb' is true,
+/// looking up 'bits' bits at once, or fewer if every code is shorter.
+/// Throw std::invalid_argument if 'bits' exceeds decode_image_max_bits, and
+/// std::runtime_error if the table does not fit.
+template <class T>
+BinaryBlob build_decode_image (const U8* table, std::size_t table_size, bool lsb,
+                               unsigned bits = decode_table_bits,
+                               std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    if (bits > decode_image_max_bits)
+        throw std::invalid_argument("decode image lookup table too large");
+    table_size = checked_arrays_size<T>(table, table_size);
+
+    const U8* ptr = table;
+    std::pmr::vector<T> alphabet(mr);
+    std::pmr::vector<U8> lengths(mr);
+    Bitseq alphabits(mr);
+    deserialise_arrays(ptr, alphabet, lengths, alphabits);
+    const std::size_t N = alphabet.size();
+    if (N == 0)
+        throw std::invalid_argument("cannot build a decode image of an empty table");
+
+    // the tree, with the root at index 0
+    std::pmr::vector<ImageNode> nodes(mr);
+    unsigned max_length = 0;
+    for (std::size_t i = 0, o = 0; i < N; o += lengths[i++])
+    {
+        max_length = std::max<unsigned>(max_length, lengths[i]);
+        if (lengths[i] == 0) continue;
+        if (nodes.empty())
+            nodes.push_back(ImageNode{{0, 0}});
+        U32 n = 0;
+        for (std::size_t j = 0; j < lengths[i]; ++j)
+        {
+            U32& c = nodes[n].child[alphabits[o+j]];
+            if (c & image_leaf)
+                throw std::runtime_error("invalid table: a code is a prefix of another");
+            if (j + 1 == lengths[i])
+            {
+                if (c != 0)
+                    throw std::runtime_error("invalid table: a code is a prefix of another");
+                c = image_leaf | (U32) i;
+            }
+            else
+            {
+                if (c == 0)
+                {
+                    c = (U32) nodes.size();
+                    nodes.push_back(ImageNode{{0, 0}}); // 'c' is invalidated
+                }
+                n = nodes[n].child[alphabits[o+j]];
+            }
+        }
+    }
+    bits = std::min(bits, max_length);
+
+    // the lookup table, as in DecodeTable
+    std::pmr::vector<DecodeEntry> entries(std::size_t(1) << bits,
+                                          DecodeEntry{0, decode_long_code}, mr);
+    for (std::size_t i = 0, o = 0; i < N; o += lengths[i++])
+    {
+        std::size_t L = lengths[i];
+        if (L == 0 || L > bits) continue;
+        std::size_t prefix = 0;
+        for (std::size_t j = 0; j < L; ++j)
+            if (alphabits[o+j])
+                prefix |= std::size_t(1) << (lsb ? j : bits-1-j);
+        DecodeEntry e{(U32) i, (U32) L};
+        for (std::size_t r = 0; r < (std::size_t(1) << (bits-L)); ++r)
+            entries[lsb ? prefix | r << L : prefix | r] = e;
+    }
+
+    ImageHeader h = {};
+    memcpy(h.magic, decode_image_magic, 8);
+    h.version = decode_image_version;
+    h.byte_order = decode_image_byte_order;
+    h.symbol_size = sizeof(T);
+    h.flags = lsb ? hef_lsb : 0;
+    h.num_symbols = (U32) N;
+    h.bits = bits;
+    h.num_nodes = (U32) nodes.size();
+    h.table_size = (U32) table_size;
+    h.symbols_offset = sizeof(ImageHeader);
+    h.entries_offset = align8(h.symbols_offset + N * sizeof(T));
+    h.nodes_offset = align8(h.entries_offset + entries.size() * sizeof(DecodeEntry));
+    h.table_offset = align8(h.nodes_offset + nodes.size() * sizeof(ImageNode));
+    h.size = align8(h.table_offset + h.table_size);
+
+    BinaryBlob image(h.size, 0, mr);
+    U8* out = (U8*) image.data();
+    memcpy(out + h.symbols_offset, alphabet.data(), N * sizeof(T));
+    memcpy(out + h.entries_offset, entries.data(), entries.size() * sizeof(DecodeEntry));
+    if (!nodes.empty())
+        memcpy(out + h.nodes_offset, nodes.data(), nodes.size() * sizeof(ImageNode));
+    memcpy(out + h.table_offset, table, h.table_size);
+    h.checksum = fnv1a64(out + sizeof(ImageHeader), h.size - sizeof(ImageHeader));
+    memcpy(out, &h, sizeof(h));
+    return image;
+}
+
+/// Build the decode image of the table.
+template <class T>
+BinaryBlob build_decode_image (const Table<T>& table, bool lsb = false,
+                               unsigned bits = decode_table_bits,
+                               std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    std::pmr::vector<T> alphabet(mr);
+    std::pmr::vector<U8> lengths(mr);
+    Bitseq alphabits(mr);
+    make_arrays(table, alphabet, lengths, alphabits);
+    BinaryBlob serial = serialise_arrays(alphabet, lengths, alphabits);
+    return build_decode_image<T>((const U8*) serial.data(), serial.size(), lsb, bits, mr);
+}
+
+/// Build the decode image of the table of the HEF blob, for its bit order.
+template <class T>
+BinaryBlob build_decode_image (const BinaryBlob& blob, unsigned bits = decode_table_bits,
+                               std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    if (blob.empty())
+        throw std::runtime_error("empty blob");
+    U8 F = blob[0];
+    check_plain(F);
+    return build_decode_image<T>((const U8*) blob.data() + 1, blob.size() - 1, F & hef_lsb,
+                                 bits, mr);
+}
+
+/// Decode the binary blob with the decode image of its table.
+/// The decoded symbols are appended to the container, which is resized once.
+/// Throw std::invalid_argument if the blob was not encoded with the image's
+/// table and bit order.
+template <class T, class cont_t>
+void decode (const BinaryBlob& blob, cont_t& cont, const DecodeImage<T>& image)
+{
+    const U8* ptr = (const U8*) blob.c_str();
+    U8 F = *ptr++;
+    check_plain(F);
+    const U8* table = ptr;
+    skip_arrays<T>(ptr);
+    if ((std::size_t) (ptr - table) != image.table_size()
+        || memcmp(table, image.table(), image.table_size()) != 0)
+        throw std::invalid_argument("blob was not encoded with the decode image's table");
+    if (bool(F & hef_lsb) != image.lsb())
+        throw std::invalid_argument("blob and decode image have different bit orders");
+
+    std::size_t K = deserialise_num(ptr);
+    if (F & hef_indexed)
+        deserialise_index(ptr, K, nullptr);
+    std::size_t M = deserialise_payload_size(ptr);
+
+    std::size_t offset = cont.size();
+    cont.resize(offset + K);
+    std::size_t pos = 0;
+    image.decode(ptr, M, pos, K, cont.begin() + offset);
+}
+
+} // namespace kxh
@@ -0,0 +1,58 @@
+/*
+ * Explicit instantiations for common symbol types.
+ *
+ * The kxhuffman library (see the top-level Makefile) instantiates the
+ * encoders and decoders below for char, U8, U16, U32 and U64 symbols, in
+ * std::vector containers, and for char symbols in std::string and
+ * std::pmr::string (BinaryBlob). Programs that link against the library may
+ * define KXH_EXTERN_TEMPLATES to declare these instantiations extern, so that
+ * they are compiled once in the library rather than in every translation
+ * unit. Other instantiations are still generated from the headers as usual.
+ */
+
+#pragma once
+
+#include "huffman.h"
+#include "common.h"
+
+#include <string>
+#include <vector>
+
+// 'prefix' is empty to instantiate, 'extern' to declare.
+
+#define KXH_INSTANTIATE_ITER(prefix, T, iter_t) \
+    prefix template BinaryBlob encode<T, iter_t> (iter_t, const iter_t&, MemoryStats*, std::pmr::memory_resource*); \
+    prefix template BinaryBlob encode_indexed<T, iter_t> (iter_t, const iter_t&, std::size_t, std::pmr::memory_resource*); \
+    prefix template BinaryBlob encode_parallel<T, iter_t> (iter_t, const iter_t&, std::size_t, std::pmr::memory_resource*); \
+    prefix template BinaryBlob encode_parallel<T, iter_t> (iter_t, const iter_t&, Executor&, std::size_t, std::pmr::memory_resource*);
+
+#define KXH_INSTANTIATE_CONT(prefix, T, cont_t) \
+    KXH_INSTANTIATE_ITER(prefix, T, cont_t::iterator) \
+    KXH_INSTANTIATE_ITER(prefix, T, cont_t::const_iterator) \
+    prefix template void decode<T, cont_t> (const BinaryBlob&, cont_t&, MemoryStats*, std::pmr::memory_resource*); \
+    prefix template void decode_parallel<T, cont_t> (const BinaryBlob&, cont_t&, Executor&, std::pmr::memory_resource*);
+
+#define KXH_INSTANTIATE_SYMBOL(prefix, T) \
+    prefix template class HuffmanTree<T>; \
+    KXH_INSTANTIATE_CONT(prefix, T, std::vector<T>) \
+    prefix template std::size_t decode<T> (const BinaryBlob&, T*, std::size_t, std::pmr::memory_resource*); \
+    prefix template std::size_t decoded_size<T> (const BinaryBlob&, std::pmr::memory_resource*); \
+    prefix template T* decode_range<T, T*> (const BinaryBlob&, std::size_t, std::size_t, T*, std::pmr::memory_resource*);
+
+#define KXH_INSTANTIATE_ALL(prefix) \
+    KXH_INSTANTIATE_SYMBOL(prefix, char) \
+    KXH_INSTANTIATE_CONT(prefix, char, std::string) \
+    KXH_INSTANTIATE_CONT(prefix, char, std::pmr::string) \
+    KXH_INSTANTIATE_SYMBOL(prefix, U8) \
+    KXH_INSTANTIATE_SYMBOL(prefix, U16) \
+    KXH_INSTANTIATE_SYMBOL(prefix, U32) \
+    KXH_INSTANTIATE_SYMBOL(prefix, U64)
+
+#ifdef KXH_EXTERN_TEMPLATES
+namespace kxh
+{
+
+KXH_INSTANTIATE_ALL(extern)
+
+} // namespace kxh
+#endif
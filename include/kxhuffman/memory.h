@@ -0,0 +1,347 @@
+/*
+ * Memory accounting.
+ *
+ * encode() and decode() optionally report the memory used by each of their
+ * stages in a MemoryStats. When they are given one, they allocate through a
+ * StageMeter, a memory resource wrapped around 'mr' that counts the bytes
+ * allocated and the live bytes, and close every stage on it. The figures
+ * are the requested sizes, so they exclude the allocator's own overhead and
+ * the caller's input. The blob returned by encode() and the container filled
+ * by decode() outlive the call, so they are not allocated through the meter;
+ * their storage is counted on it when they are allocated.
+ *
+ * encode() runs the following stages, each holding on to the data of the
+ * previous stages as listed:
+ *
+ *   stage        builds                          also holds
+ *   frequencies  frequency map F
+ *   tree         tree N, priority queue Q        F
+ *   table        table of codes T                N
+ *   code         code lookups L, bit sequence C  N, T
+ *   output       header H, payload P, blob O     N, T, C
+ *
+ * decode() builds the table (and the header arrays it is read from), then
+ * the tree and the lookup table of a DecodeTable, then the output symbols.
+ *
+ * For n input symbols of type T, encode_footprint() and decode_footprint()
+ * bound every stage with the worst case of:
+ *
+ *   k = min(n, 2^(8 sizeof(T)))       distinct symbols
+ *   L = min(k-1, ceil(1.44 log2(n)))  longest code, since a code of length L
+ *                                     needs a total frequency of Fib(L+2)
+ *   B = n max(1, ceil(log2(k)))       code bits, since a Huffman code is never
+ *                                     longer than a fixed-length code
+ *
+ * with hash maps of k entries and at most 3k+16 buckets, a tree of 2k-1
+ * nodes, and vectors and strings at most twice their size since they grow
+ * by doubling. For small alphabets the peak is in the output stage, which
+ * holds the code (up to 2 B/8 bytes), the payload (B/8) and the blob (B/8):
+ * about 4 B/8 bytes, or four times the size of the encoded data.
+ * decode() peaks at n sizeof(T) bytes plus the O(k) table, tree and lookups.
+ */
+
+#pragma once
+
+#include "HuffmanTree.h"
+#include "Bitseq.h"
+#include "cpu.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory_resource>
+#include <string>
+#include <utility>
+
+namespace kxh
+{
+
+/// Minimum number of byte symbols for which encoding builds a pair table.
+const std::size_t pair_table_min_symbols = 1 << 16;
+
+/// Longest pair of codes held by the pair table, so that the codes of two
+/// bytes and their length fit in 32 bits. Longer pairs are escapes, encoded
+/// as two single codes.
+const std::size_t pair_table_max_length = 24;
+
+/// Memory used by a stage of encoding or decoding.
+struct StageMemory
+{
+    std::size_t allocated = 0; // bytes allocated during the stage
+    std::size_t peak = 0;      // peak live bytes, including earlier stages' data
+};
+
+/// Memory used by a call to encode() or decode().
+struct MemoryStats
+{
+    StageMemory frequencies; // the frequency map
+    StageMemory tree;        // the Huffman tree, and the decoder's lookups
+    StageMemory table;       // the table of codes
+    StageMemory code;        // the encoded bit sequence
+    StageMemory output;      // the encoded blob, or the decoded symbols
+
+    /// Return the bytes allocated by all the stages.
+    std::size_t allocated () const {
+        return frequencies.allocated + tree.allocated + table.allocated
+             + code.allocated + output.allocated;
+    }
+
+    /// Return the peak live bytes over all the stages.
+    std::size_t peak () const {
+        return std::max({frequencies.peak, tree.peak, table.peak, code.peak, output.peak});
+    }
+};
+
+/// Return the bytes allocated by a hash map of 'size' entries and 'buckets'
+/// buckets. Every node holds a next pointer, the entry and a cached hash.
+template <class K, class V>
+std::size_t hash_map_bytes (std::size_t size, std::size_t buckets)
+{
+    return size * (sizeof(void*) + sizeof(std::pair<const K,V>) + sizeof(std::size_t))
+         + buckets * sizeof(void*);
+}
+
+/// Return the bytes allocated by a Huffman tree with 'num_leaves' leaves.
+template <class T>
+std::size_t tree_bytes (std::size_t num_leaves)
+{
+    if (num_leaves == 0) return 0;
+    return (2*num_leaves - 1) * sizeof(node<T>) + num_leaves * sizeof(T);
+}
+
+/// Return the capacity of a vector grown one element at a time to 'size'.
+inline std::size_t grown_capacity (std::size_t size)
+{
+    std::size_t c = 1;
+    while (c < size)
+        c *= 2;
+    return size == 0 ? 0 : c;
+}
+
+/// Return the size of the serialised bit sequence of 'num_bits' bits.
+inline std::size_t serialised_bitseq_bytes (std::size_t num_bits)
+{
+    std::size_t M_bytes = num_bits/8;
+    std::size_t num = M_bytes <= 255 ? 2 : M_bytes <= 65535 ? 3 : M_bytes <= 4294967295 ? 5 : 9;
+    return num + 1 + (num_bits+7)/8;
+}
+
+/// A memory resource that forwards to an upstream resource and measures,
+/// stage by stage, the bytes allocated and the peak of the live bytes.
+/// It is not thread-safe.
+class StageMeter : public std::pmr::memory_resource
+{
+public:
+
+    explicit StageMeter (std::pmr::memory_resource* upstream)
+        : upstream(upstream), live(0), allocated(0), peak(0) {}
+
+    /// Record the bytes allocated since the previous stage ended and the
+    /// peak live bytes in between, then start the next stage.
+    void end_stage (StageMemory& stage)
+    {
+        stage.allocated = allocated;
+        stage.peak = peak;
+        allocated = 0;
+        peak = live;
+    }
+
+    /// Count 'bytes' allocated elsewhere, such as the caller's container, as
+    /// allocated now and live from now on.
+    void count_outside (std::size_t bytes)
+    {
+        live += bytes;
+        allocated += bytes;
+        peak = std::max(peak, live);
+    }
+
+private:
+
+    void* do_allocate (std::size_t bytes, std::size_t align) override
+    {
+        void* p = upstream->allocate(bytes, align);
+        live += bytes;
+        allocated += bytes;
+        peak = std::max(peak, live);
+        return p;
+    }
+
+    void do_deallocate (void* p, std::size_t bytes, std::size_t align) override
+    {
+        live -= bytes;
+        upstream->deallocate(p, bytes, align);
+    }
+
+    bool do_is_equal (const std::pmr::memory_resource& that) const noexcept override {
+        return this == &that;
+    }
+
+    std::pmr::memory_resource* upstream;
+    std::size_t live;      // bytes allocated and not yet deallocated
+    std::size_t allocated; // bytes allocated during the current stage
+    std::size_t peak;      // peak of 'live' during the current stage
+};
+
+/// Return the bytes held by the container's storage.
+template <class cont_t>
+auto container_bytes (const cont_t& cont, int)
+    -> decltype(cont.capacity(), std::size_t())
+{
+    return cont.capacity() * sizeof(typename cont_t::value_type);
+}
+
+/// Return the bytes held by the elements of a container without capacity().
+template <class cont_t>
+std::size_t container_bytes (const cont_t& cont, long)
+{
+    return cont.size() * sizeof(typename cont_t::value_type);
+}
+
+/// Return the bytes held by the container's storage.
+template <class cont_t>
+std::size_t container_bytes (const cont_t& cont)
+{
+    return container_bytes(cont, 0);
+}
+
+/// Return the bytes allocated by the string: none if it is stored in place,
+/// its capacity and terminator otherwise.
+template <class C, class traits_t, class alloc_t>
+std::size_t container_bytes (const std::basic_string<C,traits_t,alloc_t>& s)
+{
+    const char* p = (const char*) s.data();
+    bool in_place = p >= (const char*) &s && p < (const char*) (&s + 1);
+    return in_place ? 0 : (s.capacity() + 1) * sizeof(C);
+}
+
+/// Fill in the bounds of the stages of encode() from the sizes of its data
+/// structures: the number of symbols 'k', the frequency map 'F', the table
+/// 'Tb', the code lookups 'L', the encoded bit sequence 'C', the header 'H',
+/// the payload 'P' and the blob 'O'.
+template <class T>
+void bound_encode (MemoryStats& stats, std::size_t k, std::size_t F,
+                   std::size_t Tb, std::size_t L, std::size_t C, std::size_t H,
+                   std::size_t P, std::size_t O)
+{
+    const std::size_t N = tree_bytes<T>(k);
+    const std::size_t Q = grown_capacity(k) * sizeof(qelem<T>);
+    // the header's arrays, the serialised tree and the header itself
+    const std::size_t header = 3*H;
+
+    stats = MemoryStats();
+    stats.frequencies.allocated = F;
+    stats.frequencies.peak = F;
+
+    stats.tree.allocated = N + 2*Q;
+    stats.tree.peak = F + N + Q + Q/2;
+
+    stats.table.allocated = Tb;
+    stats.table.peak = N + Tb;
+
+    stats.code.allocated = L + 2*C;
+    stats.code.peak = N + Tb + L + C + C/2;
+
+    stats.output.allocated = header + P + O;
+    stats.output.peak = N + Tb + C + header + P + O;
+}
+
+/// Fill in the bounds of the stages of decode() from the sizes of its data
+/// structures: the number of symbols 'k', the header arrays 'A', the table
+/// 'Tb', the decode lookups 'D' and the decoded output 'O'.
+template <class T>
+void bound_decode (MemoryStats& stats, std::size_t k, std::size_t A,
+                   std::size_t Tb, std::size_t D, std::size_t O)
+{
+    const std::size_t N = tree_bytes<T>(k);
+
+    stats = MemoryStats();
+    stats.table.allocated = A + Tb;
+    stats.table.peak = A + Tb;
+
+    stats.tree.allocated = N + D;
+    stats.tree.peak = Tb + N + D;
+
+    stats.output.allocated = O;
+    stats.output.peak = Tb + N + D + O;
+}
+
+/// Return an upper bound of the number of distinct symbols of type T in a
+/// sequence of 'num_symbols' symbols.
+template <class T>
+std::size_t max_alphabet_size (std::size_t num_symbols)
+{
+    if (sizeof(T) >= sizeof(std::size_t))
+        return num_symbols;
+    return std::min<std::size_t>(num_symbols, std::size_t(1) << (8*sizeof(T)));
+}
+
+/// Return an upper bound of the length of the longest code for a sequence
+/// of 'num_symbols' symbols with 'k' distinct symbols.
+/// A code of length L needs a total frequency of at least Fib(L+2) > phi^L.
+inline std::size_t max_code_length (std::size_t num_symbols, std::size_t k)
+{
+    if (k <= 1) return 0;
+    std::size_t L = (std::size_t) std::ceil(1.4405 * std::log2((double) num_symbols));
+    return std::min(k-1, L);
+}
+
+/// Return an upper bound of the memory used by encode() on a sequence of
+/// 'num_symbols' symbols, excluding the input.
+template <class T>
+MemoryStats encode_footprint (std::size_t num_symbols)
+{
+    const std::size_t n = num_symbols;
+    const std::size_t k = max_alphabet_size<T>(n);
+    const std::size_t L = max_code_length(n, k);
+    const std::size_t buckets = 3*k + 16;
+    const std::size_t code_blocks = std::max<std::size_t>(1, (L + bpp-1) / bpp);
+
+    std::size_t bits_per_symbol = 1;
+    while ((std::size_t(1) << bits_per_symbol) < k)
+        bits_per_symbol++;
+    const std::size_t B = n * bits_per_symbol;
+
+    const std::size_t F  = hash_map_bytes<T,U64>(k, buckets);
+    const std::size_t Tb = hash_map_bytes<T,Bitseq>(k, buckets) + k * code_blocks * sizeof(Block);
+    const std::size_t C  = 2 * (B/bpp + 1) * sizeof(Block);
+    const std::size_t H  = k * (sizeof(T) + 1) + (k*L + 7)/8 + 19;
+    const std::size_t P  = serialised_bitseq_bytes(B);
+
+    // the lookups of the byte encoder: the pair table for large inputs, or
+    // a copy of every code if one can be longer than a block
+    std::size_t lookup = 0;
+    if (sizeof(T) == 1 && n >= pair_table_min_symbols && k > 1)
+        lookup = 65536 * sizeof(U32);
+    if (sizeof(T) == 1 && L > (std::size_t) bpp)
+        lookup = std::max(lookup, 256 * sizeof(Bitseq) + k * code_blocks * sizeof(Block));
+
+    MemoryStats stats;
+    bound_encode<T>(stats, k, F, Tb, lookup, C, H, P, H + P);
+    return stats;
+}
+
+/// Return an upper bound of the memory used by decode() on a blob of
+/// 'num_symbols' symbols, excluding the blob and the container's previous
+/// contents.
+template <class T>
+MemoryStats decode_footprint (std::size_t num_symbols)
+{
+    const std::size_t n = num_symbols;
+    const std::size_t k = max_alphabet_size<T>(n);
+    const std::size_t L = max_code_length(n, k);
+    const std::size_t buckets = 3*k + 16;
+    const std::size_t code_blocks = std::max<std::size_t>(1, (L + bpp-1) / bpp);
+
+    const std::size_t A  = grown_capacity(k) * (sizeof(T) + 1) + 2 * ((k*L)/bpp + 1) * sizeof(Block);
+    const std::size_t Tb = hash_map_bytes<T,Bitseq>(k, buckets) + k * code_blocks * sizeof(Block);
+    // the symbols, their indices and the lookup table of a DecodeTable
+    const std::size_t D  = grown_capacity(k) * sizeof(T) + hash_map_bytes<T,U32>(k, buckets)
+                         + (std::size_t(1) << std::min<std::size_t>(L, decode_table_bits))
+                           * sizeof(DecodeEntry);
+
+    MemoryStats stats;
+    bound_decode<T>(stats, k, A, Tb, D, n * sizeof(T));
+    return stats;
+}
+
+} // namespace kxh
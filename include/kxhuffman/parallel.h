@@ -0,0 +1,237 @@
+/*
+ * Parallel encoding and decoding of a single input.
+ *
+ * encode_parallel() produces exactly the same HEF blob as encode(), so
+ * decoders need no change. The input is split into chunks, which run on an
+ * executor (see executor.h):
+ *
+ * 1. Every chunk sums the code lengths of its symbols.
+ * 2. A prefix sum over the chunk lengths gives every chunk the bit offset
+ *    at which its codes start in the output.
+ * 3. Every chunk is encoded directly into the shared output blocks.
+ *    A block that straddles two chunks is written by neither; each chunk
+ *    returns its partial boundary blocks, which are merged at the end.
+ *
+ * The frequency count and the tree are computed serially, since the tree
+ * (and therefore the output) must not depend on the number of chunks.
+ *
+ * decode_parallel() decodes a blob with a seek index in segments that start
+ * at index entries; other blobs are decoded serially.
+ */
+
+#pragma once
+
+#include "huffman.h"
+#include "executor.h"
+#include "common.h"
+
+#include <vector>
+#include <iterator>
+#include <memory_resource>
+#include <algorithm>
+
+namespace kxh
+{
+
+/// Write right-aligned codes, most significant bit first, into an array of
+/// blocks starting at an arbitrary bit offset.
+/// The first and last blocks written may be shared with the neighbouring
+/// chunks of the output, so they are kept aside in 'head' and 'tail' instead
+/// of being stored in the array.
+class ChunkWriter
+{
+public:
+
+    ChunkWriter (Block* blocks, std::size_t offset)
+        : blocks(blocks), word(offset / bpp), acc(0), count(offset % bpp),
+          head(0), tail(0), head_word(offset / bpp), tail_word(offset / bpp),
+          started(false) {}
+
+    /// Push the code.
+    void push (const Code& c) {
+        if (c.length == 0) return;
+        const std::size_t len = c.length;
+        if (count + len < (std::size_t) bpp) // fits in the current block
+        {
+            acc |= c.bits << (bpp - count - len);
+            count += len;
+        }
+        else
+        {
+            std::size_t rest = len - (bpp - count); // bits for the next block
+            acc |= c.bits >> rest;
+            emit();
+            acc = rest == 0 ? 0 : c.bits << (bpp - rest);
+            count = rest;
+        }
+    }
+
+    /// Flush the last, partial block.
+    void finish () {
+        if (count > 0 && !started)
+            head = acc;
+        else if (count > 0)
+        {
+            tail = acc;
+            tail_word = word;
+        }
+    }
+
+    Block head_block () const { return head; }
+    Block tail_block () const { return tail; }
+    std::size_t head_index () const { return head_word; }
+    std::size_t tail_index () const { return tail_word; }
+
+private:
+
+    void emit () {
+        if (!started)
+        {
+            head = acc;
+            started = true;
+        }
+        else blocks[word] = acc;
+        word++;
+    }
+
+    Block* blocks;
+    std::size_t word;  // index of the block being filled
+    Block acc;         // the block being filled
+    std::size_t count; // number of bits in 'acc', in [0,bpp)
+    Block head, tail;
+    std::size_t head_word, tail_word;
+    bool started;      // whether the first block has been emitted
+};
+
+/// Encode the sequence using the given Huffman table in 'num_chunks'
+/// chunks on the executor, or one per unit of its concurrency if 0. The
+/// iterators must be random access.
+/// The result is identical to encode_seq().
+template <class T, class iter_t>
+Bitseq encode_seq_parallel (iter_t begin, const iter_t& end, const Table<T>& table,
+                            Executor& executor, std::size_t num_chunks = 0)
+{
+    const std::size_t n = std::distance(begin, end);
+    if (num_chunks == 0)
+        num_chunks = executor.concurrency();
+    num_chunks = std::max<std::size_t>(1, std::min(num_chunks, n / 4096));
+
+    for (const auto& keyval : table) // codes longer than a block are rare
+        if (keyval.second.size() > (std::size_t) bpp)
+            return encode_seq<T,iter_t>::encode(begin, end, table);
+    const CodeLookup<T> codes(table);
+
+    std::pmr::memory_resource* mr = table.get_allocator().resource();
+
+    // chunk boundaries
+    std::pmr::vector<std::size_t> bounds(num_chunks+1, mr);
+    for (std::size_t i = 0; i <= num_chunks; ++i)
+        bounds[i] = n * i / num_chunks;
+
+    // 1. bit length of every chunk
+    std::pmr::vector<std::size_t> offsets(num_chunks+1, 0, mr);
+    executor.parallel_for(num_chunks, [&] (std::size_t i) {
+        std::size_t bits = 0;
+        for (iter_t it = begin + bounds[i], e = begin + bounds[i+1]; it != e; ++it)
+            bits += codes(*it).length;
+        offsets[i+1] = bits;
+    });
+
+    // 2. starting bit offset of every chunk
+    for (std::size_t i = 0; i < num_chunks; ++i)
+        offsets[i+1] += offsets[i];
+    const std::size_t total = offsets[num_chunks];
+
+    // 3. encode every chunk in place
+    std::pmr::vector<Block> blocks(std::max<std::size_t>(1, (total + bpp - 1) / bpp), 0, mr);
+    std::pmr::vector<ChunkWriter> writers(mr);
+    for (std::size_t i = 0; i < num_chunks; ++i)
+        writers.emplace_back(&blocks[0], offsets[i]);
+    executor.parallel_for(num_chunks, [&] (std::size_t i) {
+        ChunkWriter& w = writers[i];
+        for (iter_t it = begin + bounds[i], e = begin + bounds[i+1]; it != e; ++it)
+            w.push(codes(*it));
+        w.finish();
+    });
+
+    // merge the boundary blocks
+    for (const ChunkWriter& w : writers)
+    {
+        if (w.head_block()) blocks[w.head_index()] |= w.head_block();
+        if (w.tail_block()) blocks[w.tail_index()] |= w.tail_block();
+    }
+
+    return Bitseq(std::move(blocks), total);
+}
+
+/// Encode the sequence using Huffman encoding in 'num_chunks' chunks on the
+/// executor, or one per unit of its concurrency if 0. The iterators must be
+/// random access.
+/// The result is identical to encode().
+/// All the memory used by the call, including the returned blob, is
+/// allocated from 'mr', on the calling thread.
+template <class T, class iter_t>
+BinaryBlob encode_parallel (iter_t begin, const iter_t& end, Executor& executor,
+                            std::size_t num_chunks = 0,
+                            std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    HuffmanTree<T> t(begin, end, mr);
+    Table<T> table = t.make_table();
+    Bitseq code = encode_seq_parallel<T>(begin, end, table, executor, num_chunks);
+    std::size_t num_symbols = std::distance(begin, end);
+    return serialise<T>(table, num_symbols, code);
+}
+
+/// Encode the sequence using Huffman encoding in 'num_threads' chunks on
+/// the default executor, or one per hardware thread if 0. The iterators must
+/// be random access.
+/// The result is identical to encode().
+/// All the memory used by the call, including the returned blob, is
+/// allocated from 'mr'.
+template <class T, class iter_t>
+BinaryBlob encode_parallel (iter_t begin, const iter_t& end, std::size_t num_threads = 0,
+                            std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    if (num_threads == 1)
+    {
+        InlineExecutor serial;
+        return encode_parallel<T>(begin, end, serial, 1, mr);
+    }
+    return encode_parallel<T>(begin, end, default_executor(), num_threads, mr);
+}
+
+/// Decode the binary blob on the executor, in one segment of consecutive
+/// seek index entries per unit of its concurrency. Blobs without a seek
+/// index are decoded serially.
+/// The decoded symbols are appended to the container, which is resized once
+/// and must have random access iterators.
+/// The table and its lookups are allocated from 'mr'; the index is read in
+/// place.
+template <class T, class cont_t>
+void decode_parallel (const BinaryBlob& blob, cont_t& cont, Executor& executor,
+                      std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    Table<T> table(mr);
+    std::size_t K;
+    SeekIndexView index;
+    const U8* ptr = (const U8*) blob.c_str();
+    U8 F = deserialise_header(ptr, table, K, &index);
+    const DecodeTable<T> codes(table, F & hef_lsb, mr);
+
+    std::size_t offset = cont.size();
+    cont.resize(offset + K);
+    auto out = cont.begin() + offset;
+
+    // segment s starts at index entry s*E/S, where entry 0 is symbol 0
+    const std::size_t E = index.size + 1;
+    const std::size_t S = index.granularity == 0 ? 1 : std::min(E, executor.concurrency());
+    executor.parallel_for(S, [&] (std::size_t s) {
+        std::size_t first = E * s / S, last = E * (s+1) / S;
+        std::size_t start = first * index.granularity;
+        std::size_t stop = s+1 == S ? K : last * index.granularity;
+        std::size_t bit = first == 0 ? 0 : index[first-1];
+        decode_payload(ptr, F, codes, stop - start, out + start, bit);
+    });
+}
+
+} // namespace kxh
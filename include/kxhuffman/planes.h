@@ -0,0 +1,163 @@
+/*
+ * Byte-plane coding of wide symbols.
+ *
+ * Symbols wider than a byte, such as 16-bit samples, floats or small
+ * records, make large alphabets when coded whole, although their bytes
+ * often behave very differently: the high bytes of slowly varying samples
+ * are highly predictable, the low bytes close to random. encode_planes()
+ * transposes the input into sizeof(T) byte planes, plane j holding byte j
+ * of every symbol in memory order, and codes every plane on its own with the
+ * byte path: at most 256 codes per plane, the histogram kernel, and the pair
+ * lookups. A plane that Huffman coding does not shrink is stored raw.
+ *
+ * The output is:
+ *
+ *   [F: U8]          hef_planes
+ *   [P: num]         number of planes, sizeof(T)
+ *   [K: num]         number of symbols
+ *   P times:
+ *     [mode: U8]     plane_raw or plane_huffman
+ *     [size: num]    bytes of the plane
+ *     [plane]        K raw bytes, or a HEF blob of K U8 symbols
+ *
+ * Planes follow the byte order of the host, like the alphabet of a HEF
+ * file. decode_planes() decodes every Huffman plane with a DecodeTable and
+ * transposes the planes back.
+ */
+
+#pragma once
+
+#include "huffman.h"
+#include "common.h"
+
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <memory_resource>
+#include <stdexcept>
+#include <type_traits>
+
+namespace kxh
+{
+
+/// How a byte plane is stored.
+enum plane_mode
+{
+    plane_raw     = 0, // the bytes as they are
+    plane_huffman = 1  // a HEF blob of the bytes
+};
+
+/// Encode the symbols as sizeof(T) byte planes, each Huffman coded or stored
+/// raw, whichever is smaller.
+/// The memory used by the call, including the returned blob, is allocated
+/// from 'mr'.
+template <class T, class iter_t>
+BinaryBlob encode_planes (iter_t begin, const iter_t& end,
+                          std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    static_assert(std::is_trivially_copyable<T>::value, "byte planes take trivially copyable symbols");
+    const std::size_t P = sizeof(T);
+    const std::size_t K = std::distance(begin, end);
+
+    // transpose: byte j of symbol i goes to planes[j*K + i]
+    std::pmr::vector<U8> planes(P * K, mr);
+    for (std::size_t i = 0; begin != end; ++begin, ++i)
+    {
+        U8 bytes[sizeof(T)];
+        const T x = *begin;
+        memcpy(bytes, &x, P);
+        for (std::size_t j = 0; j < P; ++j)
+            planes[j*K + i] = bytes[j];
+    }
+
+    U8 F = hef_planes;
+    BinaryBlob blob(1, (char) F, mr);
+    blob += serialise_num(P, mr);
+    blob += serialise_num(K, mr);
+    for (std::size_t j = 0; j < P; ++j)
+    {
+        const U8* plane = planes.data() + j*K;
+        BinaryBlob coded = K > 0 ? encode<U8>(plane, plane + K, nullptr, mr) : BinaryBlob(mr);
+        bool raw = K == 0 || coded.size() >= K;
+        blob += (char) (raw ? plane_raw : plane_huffman);
+        blob += serialise_num(raw ? K : coded.size(), mr);
+        if (raw)
+            blob.append((const char*) plane, K);
+        else
+            blob += coded;
+    }
+    return blob;
+}
+
+/// Decode the HEF blob of byte symbols at 'ptr' into 'count' bytes at 'out'.
+/// Throw std::runtime_error if it does not hold 'count' symbols.
+inline void decode_plane (const U8* ptr, U8* out, std::size_t count,
+                          std::pmr::memory_resource* mr)
+{
+    Table<U8> table(mr);
+    std::size_t K;
+    U8 F = deserialise_header(ptr, table, K);
+    if (K != count)
+        throw std::runtime_error("invalid byte plane");
+    std::size_t M = deserialise_payload_size(ptr);
+
+    const DecodeTable<U8> codes(table, F & hef_lsb, mr);
+    U8 symbols[256];
+    for (std::size_t i = 0; i < codes.size(); ++i)
+        symbols[i] = codes.symbol(i);
+    std::size_t pos = 0;
+    codes.scan(ptr, M, pos, K, [&] (std::size_t i) { *out++ = symbols[i]; return true; });
+}
+
+/// Decode the binary blob made by encode_planes().
+/// The decoded symbols are appended to the container, which is resized once.
+/// Throw std::runtime_error if the blob does not hold byte planes of T.
+template <class T, class cont_t>
+void decode_planes (const BinaryBlob& blob, cont_t& cont,
+                    std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    static_assert(std::is_trivially_copyable<T>::value, "byte planes take trivially copyable symbols");
+    const U8* ptr = (const U8*) blob.c_str();
+    const U8* end = ptr + blob.size();
+    U8 F = *ptr++;
+    if (!(F & hef_planes))
+        throw std::runtime_error("not a byte plane blob");
+    const std::size_t P = deserialise_num(ptr);
+    if (P != sizeof(T))
+        throw std::runtime_error("byte planes of another symbol type");
+    const std::size_t K = deserialise_num(ptr);
+
+    std::pmr::vector<U8> planes(P * K, mr);
+    for (std::size_t j = 0; j < P; ++j)
+    {
+        U8 mode = *ptr++;
+        std::size_t size = deserialise_num(ptr);
+        if (size > (std::size_t) (end - ptr))
+            throw std::runtime_error("truncated byte plane");
+        if (mode == plane_raw && size == K)
+        {
+            if (K > 0)
+                memcpy(planes.data() + j*K, ptr, K);
+        }
+        else if (mode == plane_huffman)
+            decode_plane(ptr, planes.data() + j*K, K, mr);
+        else
+            throw std::runtime_error("invalid byte plane");
+        ptr += size;
+    }
+
+    std::size_t offset = cont.size();
+    cont.resize(offset + K);
+    auto out = cont.begin() + offset;
+    for (std::size_t i = 0; i < K; ++i, ++out)
+    {
+        U8 bytes[sizeof(T)];
+        for (std::size_t j = 0; j < P; ++j)
+            bytes[j] = planes[j*K + i];
+        T x;
+        memcpy(&x, bytes, P);
+        *out = x;
+    }
+}
+
+} // namespace kxh
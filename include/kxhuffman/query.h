@@ -0,0 +1,184 @@
+/*
+ * Queries on encoded data.
+ *
+ * Counting a symbol, locating it or computing a histogram does not need the
+ * decoded sequence, only the boundaries and identities of the codes. An
+ * EncodedView parses the header of a HEF blob once and answers such queries
+ * by scanning the data bits in place, with no output buffer.
+ *
+ * The scan is table-driven: a DecodeTable (see decode.h) maps every value of
+ * the next 'decode_table_bits' bits of the data to the index of the symbol
+ * whose code they start with, and the length of that code. Codes longer than
+ * the table fall back to a walk down the tree. Symbols are identified by their index
+ * in the table, so that a query compares and counts small integers rather
+ * than values of T.
+ *
+ * Huffman codes do not synchronise, so a scan starts at the beginning of the
+ * data bits, or at the closest seek index entry if the blob has one. The index
+ * is read in place, so a view is cheap to keep and reuse: decoding many short
+ * ranges through one view parses the header once rather than once per range.
+ */
+
+#pragma once
+
+#include "huffman.h"
+#include "common.h"
+
+#include <algorithm>
+#include <memory_resource>
+#include <stdexcept>
+#include <vector>
+
+namespace kxh
+{
+
+/// Queries on the symbols of a HEF blob, answered without decoding it.
+template <class T>
+class EncodedView
+{
+public:
+
+    /// Parse the header of the blob and build its lookup table.
+    /// The blob must outlive the view.
+    explicit EncodedView (const BinaryBlob& blob,
+                          std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+        : data((const U8*) blob.c_str()), flags(*data), M(0), K(0),
+          table(read_header(mr), flags & hef_lsb, mr)
+    {
+        M = deserialise_payload_size(data);
+    }
+
+    /// Return the number of encoded symbols.
+    std::size_t size () const {
+        return K;
+    }
+
+    /// Return the number of occurrences of the symbol.
+    std::size_t count (const T& x) const
+    {
+        std::size_t target = table.index_of(x);
+        if (target == table.size()) return 0;
+        std::size_t n = 0;
+        scan(0, K, [&] (std::size_t i) { n += i == target; return true; });
+        return n;
+    }
+
+    /// Write the positions of the occurrences of the symbol to 'out'.
+    /// Return the output iterator past the last position.
+    template <class out_iter_t>
+    out_iter_t find_all (const T& x, out_iter_t out) const
+    {
+        std::size_t target = table.index_of(x);
+        if (target == table.size()) return out;
+        std::size_t p = 0;
+        scan(0, K, [&] (std::size_t i) {
+            if (i == target) { *out = p; ++out; }
+            p++;
+            return true;
+        });
+        return out;
+    }
+
+    /// Return the position of the first occurrence of the pattern
+    /// [begin, end), or size() if it does not occur.
+    template <class iter_t>
+    std::size_t search (iter_t begin, const iter_t& end) const
+    {
+        // the pattern as symbol indices
+        std::vector<std::size_t> pattern;
+        for (; begin != end; ++begin)
+        {
+            std::size_t i = table.index_of(*begin);
+            if (i == table.size()) return K;
+            pattern.push_back(i);
+        }
+        const std::size_t m = pattern.size();
+        if (m == 0) return 0;
+
+        // Knuth-Morris-Pratt: fail[j] is the length of the longest proper
+        // border of pattern[0,j]
+        std::vector<std::size_t> fail(m, 0);
+        for (std::size_t j = 1, k = 0; j < m; ++j)
+        {
+            while (k > 0 && pattern[j] != pattern[k]) k = fail[k-1];
+            if (pattern[j] == pattern[k]) k++;
+            fail[j] = k;
+        }
+
+        std::size_t p = 0;
+        std::size_t matched = 0;
+        std::size_t found = K;
+        scan(0, K, [&] (std::size_t i) {
+            while (matched > 0 && i != pattern[matched]) matched = fail[matched-1];
+            if (i == pattern[matched]) matched++;
+            p++;
+            if (matched == m) { found = p - m; return false; }
+            return true;
+        });
+        return found;
+    }
+
+    /// Return the histogram of the symbols [first, first+count).
+    /// Throw std::out_of_range if the range exceeds the encoded sequence.
+    FrequencyMap<T> histogram (std::size_t first, std::size_t count) const
+    {
+        std::vector<std::size_t> counts(table.size(), 0);
+        scan(first, count, [&] (std::size_t i) { counts[i]++; return true; });
+        FrequencyMap<T> freqs;
+        for (std::size_t i = 0; i < counts.size(); ++i)
+            if (counts[i] > 0)
+                freqs[table.symbol(i)] = counts[i];
+        return freqs;
+    }
+
+    /// Return the histogram of all the symbols.
+    FrequencyMap<T> histogram () const {
+        return histogram(0, K);
+    }
+
+    /// Decode the symbols [first, first+count) to 'out', like decode_range()
+    /// but without parsing the header again.
+    /// Return the output iterator past the last symbol.
+    /// Throw std::out_of_range if the range exceeds the encoded sequence.
+    template <class out_iter_t>
+    out_iter_t decode_range (std::size_t first, std::size_t count, out_iter_t out) const
+    {
+        scan(first, count, [&] (std::size_t i) { *out = table.symbol(i); ++out; return true; });
+        return out;
+    }
+
+private:
+
+    /// Deserialise the header and seek index, and advance 'data' to the data
+    /// bits.
+    /// Return the table.
+    Table<T> read_header (std::pmr::memory_resource* mr) {
+        Table<T> t(mr);
+        deserialise_header(data, t, K, &index);
+        return t;
+    }
+
+    /// Call 'visit' with the index of every symbol of [first, first+count),
+    /// in order, until it returns false.
+    template <class visit_t>
+    void scan (std::size_t first, std::size_t count, visit_t visit) const
+    {
+        if (first > K || count > K - first)
+            throw std::out_of_range("symbol range out of bounds");
+        std::size_t start;
+        std::size_t pos = seek(index, first, start);
+        if (pos > M)
+            throw std::runtime_error("invalid bit offset");
+        table.scan(data, M, pos, first - start, [] (std::size_t) { return true; });
+        table.scan(data, M, pos, count, visit);
+    }
+
+    const U8* data;  // the data bits, in the blob
+    U8 flags;
+    std::size_t M;   // number of data bits
+    std::size_t K;   // number of symbols
+    SeekIndexView index;  // in the blob
+    DecodeTable<T> table;
+};
+
+} // namespace kxh
@@ -0,0 +1,163 @@
+/*
+ * Lazy decoding.
+ *
+ * decode() materialises the whole sequence, which is wasteful when the caller
+ * only scans it once, stops early, or cannot afford n sizeof(T) bytes. A
+ * DecodedRange parses the header of a HEF blob and builds its DecodeTable
+ * once; its iterators then read the data bits in place and decode one symbol
+ * per increment with a table lookup, or down the tree for codes longer than
+ * the table. An iterator holds a bit position, the number of symbols left
+ * and a pointer to the current symbol, which is held by the decode table.
+ *
+ * The range works with range-for and the standard algorithms:
+ *
+ *   for (char c : decode_lazy<char>(blob)) ...
+ *   std::find(range.begin(), range.end(), x);
+ *
+ * The blob must outlive the range, and the range its iterators.
+ */
+
+#pragma once
+
+#include "huffman.h"
+#include "common.h"
+
+#include <cstddef>
+#include <iterator>
+#include <memory_resource>
+#include <stdexcept>
+
+namespace kxh
+{
+
+/// The symbols of a HEF blob, decoded on demand.
+template <class T>
+class DecodedRange
+{
+public:
+
+    class iterator;
+    using const_iterator = iterator;
+    using value_type = T;
+    using size_type = std::size_t;
+
+    /// Parse the header of the blob and build its decode table.
+    /// The table and its lookups are allocated from 'mr'.
+    explicit DecodedRange (const BinaryBlob& blob,
+                           std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+        : data((const U8*) blob.c_str()), M(0), K(0), flags(*data),
+          codes(read_header(mr), flags & hef_lsb, mr)
+    {
+        M = deserialise_payload_size(data);
+    }
+
+    /// Return an iterator to the first symbol, which is decoded by the call.
+    iterator begin () const {
+        return iterator(this);
+    }
+
+    /// Return the past-the-end iterator.
+    iterator end () const {
+        return iterator();
+    }
+
+    /// Return the number of encoded symbols.
+    std::size_t size () const {
+        return K;
+    }
+
+    bool empty () const {
+        return K == 0;
+    }
+
+    /// Forward iterator over the decoded symbols.
+    class iterator
+    {
+    public:
+
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        /// Construct the past-the-end iterator.
+        iterator ()
+            : range(nullptr), pos(0), remaining(0), current(nullptr) {}
+
+        reference operator* () const {
+            return *current;
+        }
+
+        pointer operator-> () const {
+            return current;
+        }
+
+        iterator& operator++ () {
+            if (--remaining > 0)
+                next();
+            return *this;
+        }
+
+        iterator operator++ (int) {
+            iterator it = *this;
+            ++*this;
+            return it;
+        }
+
+        bool operator== (const iterator& that) const {
+            return remaining == that.remaining;
+        }
+
+        bool operator!= (const iterator& that) const {
+            return remaining != that.remaining;
+        }
+
+    private:
+
+        friend class DecodedRange;
+
+        explicit iterator (const DecodedRange* range)
+            : range(range), pos(0), remaining(range->K), current(nullptr)
+        {
+            if (remaining > 0)
+                next();
+        }
+
+        /// Decode the next symbol.
+        void next () {
+            current = &range->codes.symbol(range->codes.next(range->data, range->M, pos));
+        }
+
+        const DecodedRange* range;
+        std::size_t pos;       // bit position of the next code
+        std::size_t remaining; // symbols left, including the current one
+        const T* current;
+    };
+
+private:
+
+    /// Deserialise the header, and advance 'data' to the data bits.
+    /// Return the table.
+    Table<T> read_header (std::pmr::memory_resource* mr) {
+        Table<T> table(mr);
+        flags = deserialise_header(data, table, K);
+        return table;
+    }
+
+    const U8* data;   // the data bits, in the blob
+    std::size_t M;    // number of data bits
+    std::size_t K;    // number of symbols
+    U8 flags;
+    DecodeTable<T> codes;
+};
+
+/// Return a range over the symbols of the blob that decodes them on demand.
+template <class T>
+DecodedRange<T> decode_lazy (const BinaryBlob& blob,
+                             std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    return DecodedRange<T>(blob, mr);
+}
+
+} // namespace kxh
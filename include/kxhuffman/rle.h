@@ -0,0 +1,179 @@
+/*
+ * Run-length coding with Huffman-coded tokens.
+ *
+ * A Huffman code spends at least one bit and one decode step on every
+ * symbol, however long the run it belongs to. encode_runs() turns the input
+ * into (symbol, length) tokens, one per run of equal symbols, and codes
+ * both halves of every token with Huffman codes:
+ *
+ * - the symbol with a table of the symbols that start runs,
+ * - the length minus one as a bucket and its extra bits (see bucket.h), with
+ *   a table of the buckets, so that runs of any length cost a few bits.
+ *
+ * decode_runs() decodes the tokens with two DecodeTables and writes every
+ * run at once with std::fill_n, a memset for bytes.
+ *
+ * The output is a HEF file with hef_runs set:
+ *
+ *   [F: U8]               hef_runs
+ *   [symbol table]        the arrays of a HEF header, of T
+ *   [length table]        the arrays of a HEF header, of U8 buckets
+ *   [K: num]              number of symbols
+ *   [R: num]              number of runs
+ *   [M_bytes: num][M_bits: U8]
+ *   [bits]                R times the symbol code, then the length bucket
+ *                         code and its extra bits, most significant bit first
+ *
+ * Inputs without long runs are better off with encode(): every symbol then
+ * pays for a length code too.
+ */
+
+#pragma once
+
+#include "huffman.h"
+#include "bucket.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <memory_resource>
+#include <stdexcept>
+
+namespace kxh
+{
+
+/// Serialise the table as the alphabet, lengths and alphabit arrays.
+template <class T>
+BinaryBlob serialise_table (const Table<T>& table)
+{
+    std::pmr::memory_resource* mr = table.get_allocator().resource();
+    std::pmr::vector<T> alphabet(mr);
+    std::pmr::vector<U8> lengths(mr);
+    Bitseq alphabits(mr);
+    make_arrays(table, alphabet, lengths, alphabits);
+    return serialise_arrays(alphabet, lengths, alphabits);
+}
+
+/// Deserialise the alphabet, lengths and alphabit arrays into a table.
+/// Advance the pointer past the arrays.
+template <class T>
+Table<T> deserialise_table (const U8*& ptr, std::pmr::memory_resource* mr)
+{
+    std::pmr::vector<T> alphabet(mr);
+    std::pmr::vector<U8> lengths(mr);
+    Bitseq alphabits(mr);
+    deserialise_arrays(ptr, alphabet, lengths, alphabits);
+    return make_table(alphabet, lengths, alphabits);
+}
+
+/// Encode the sequence as Huffman coded (symbol, run length) tokens.
+/// The iterators must be multi-pass.
+/// The memory used by the call, including the returned blob, is allocated
+/// from 'mr'.
+template <class T, class iter_t>
+BinaryBlob encode_runs (iter_t begin, const iter_t& end,
+                        std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    // call visit(x, length) for every run
+    auto for_each_run = [&] (auto&& visit) {
+        iter_t it = begin;
+        while (it != end)
+        {
+            const T x = *it;
+            std::size_t length = 1;
+            for (++it; it != end && *it == x; ++it)
+                length++;
+            visit(x, length);
+        }
+    };
+
+    FrequencyMap<T> symbol_freqs(mr);
+    U64 bucket_counts[bucket_count] = {};
+    std::size_t num_symbols = 0, num_runs = 0;
+    for_each_run([&] (const T& x, std::size_t length) {
+        symbol_freqs[x]++;
+        bucket_counts[value_bucket(length - 1)]++;
+        num_symbols += length;
+        num_runs++;
+    });
+
+    FrequencyMap<U8> bucket_freqs(mr);
+    for (std::size_t b = 0; b < bucket_count; ++b)
+        if (bucket_counts[b] > 0)
+            bucket_freqs[(U8) b] = bucket_counts[b];
+    Table<T> symbols(mr);
+    Table<U8> lengths(mr);
+    if (num_runs > 0)
+    {
+        symbols = HuffmanTree<T>(symbol_freqs, mr).make_table();
+        lengths = HuffmanTree<U8>(bucket_freqs, mr).make_table();
+    }
+
+    const CodeLookup<U8> length_codes(lengths);
+    Bitseq seq(mr);
+    for_each_run([&] (const T& x, std::size_t length) {
+        seq.push_seq(symbols.find(x)->second);
+        U8 b = value_bucket(length - 1);
+        const Code& c = length_codes.codes[b];
+        if (c.length > 0)
+            seq.push_bits(c.bits, c.length);
+        unsigned extra = bucket_values(b).extra;
+        if (extra > 0)
+            seq.push_bits(length - 1, extra);
+    });
+
+    BinaryBlob blob(1, (char) hef_runs, mr);
+    blob += serialise_table(symbols);
+    blob += serialise_table(lengths);
+    blob += serialise_num(num_symbols, mr);
+    blob += serialise_num(num_runs, mr);
+    blob += serialise_bitseq(seq);
+    return blob;
+}
+
+/// Decode the binary blob made by encode_runs().
+/// The decoded symbols are appended to the container, which is resized once.
+/// Throw std::runtime_error if the blob is not run-length coded or is
+/// invalid.
+template <class T, class cont_t>
+void decode_runs (const BinaryBlob& blob, cont_t& cont,
+                  std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    const U8* ptr = (const U8*) blob.c_str();
+    U8 F = *ptr++;
+    if (!(F & hef_runs))
+        throw std::runtime_error("not a run-length coded blob");
+    const DecodeTable<T> symbols(deserialise_table<T>(ptr, mr), false, mr);
+    const DecodeTable<U8> lengths(deserialise_table<U8>(ptr, mr), false, mr);
+    const std::size_t K = deserialise_num(ptr);
+    const std::size_t R = deserialise_num(ptr);
+    const std::size_t M = deserialise_payload_size(ptr);
+
+    std::pmr::vector<Bucket> buckets(lengths.size(), mr); // by symbol index
+    for (std::size_t i = 0; i < lengths.size(); ++i)
+    {
+        if (lengths.symbol(i) >= bucket_count)
+            throw std::runtime_error("invalid bucket");
+        buckets[i] = bucket_values(lengths.symbol(i));
+    }
+
+    std::size_t offset = cont.size();
+    cont.resize(offset + K);
+    auto out = cont.begin() + offset;
+    std::size_t left = K;
+    std::size_t pos = 0;
+    for (std::size_t r = 0; r < R; ++r)
+    {
+        const T& x = symbols.symbol(symbols.next(ptr, M, pos));
+        const Bucket& b = buckets[lengths.next(ptr, M, pos)];
+        U64 length = 1 + b.base + (b.extra > 0 ? read_bits(ptr, M, pos, b.extra) : 0);
+        if (length > left)
+            throw std::runtime_error("run past the end of the sequence");
+        out = std::fill_n(out, length, x);
+        left -= length;
+    }
+    if (left > 0)
+        throw std::runtime_error("runs shorter than the sequence");
+}
+
+} // namespace kxh
@@ -0,0 +1,228 @@
+/*
+ * Sampled frequency estimation.
+ *
+ * kxh::encode() reads its whole input once to count frequencies before it
+ * encodes a single bit. On large inputs with stationary statistics, counting
+ * a sample of the input gives nearly the same code for a fraction of the
+ * memory traffic.
+ *
+ * The sample consists of runs of 'sample_run' consecutive elements spread
+ * evenly over the input. Every symbol that occurs in the input must still get
+ * a code:
+ *
+ * - For byte symbols, every byte value that was not sampled is seeded with a
+ *   count of 1, against sampled counts scaled up to the size of the input.
+ * - For wider symbols, the code of the rarest sampled symbol is split in two:
+ *   one half is its new code, the other an escape prefix reserved for the
+ *   symbols the sample missed. The encoder gives a missed symbol the next
+ *   free code below the escape when it first meets it, so the input is read
+ *   once more, to encode it, and never counted in full.
+ *
+ * Codes below the escape are handed out in blocks of 2^d - 1 codes of d more
+ * bits, with d = 1, 2, 4, ... 32; the last code of a block is the escape of
+ * the next. The k-th missed symbol thus costs about 2 log2(k) bits more than
+ * the escape. The table holds the codes that were used; those left free
+ * leave the code incomplete, which decoders accept, so the output is a
+ * regular HEF blob.
+ */
+
+#pragma once
+
+#include "huffman.h"
+#include "common.h"
+
+#include <algorithm>
+#include <iterator>
+#include <cmath>
+#include <memory_resource>
+#include <optional>
+#include <stdexcept>
+
+namespace kxh
+{
+
+/// Number of consecutive elements in a sample run.
+const std::size_t sample_run = 64;
+
+/// Report on the cost of encoding with a sampled histogram.
+struct SampleStats
+{
+    std::size_t sampled_bits = 0; // size of the code built from the sample
+    std::size_t optimal_bits = 0; // size of the code built from all the input
+    std::size_t missed = 0;       // symbols missed by the sample, coded below the escape
+
+    /// Return the relative size increase caused by sampling.
+    double ratio_loss () const {
+        return optimal_bits == 0 ? 0.0
+                                 : (double) sampled_bits / optimal_bits - 1.0;
+    }
+};
+
+/// Estimate the sequence's frequency map from a sample of 'rate' of its
+/// elements, with rate in (0,1]. Counts are scaled to the size of the input.
+/// Return the full frequency map if the input is too small to sample.
+template <class T, class iter_t>
+FrequencyMap<T> compute_sampled_frequencies (iter_t begin, const iter_t& end,
+                                             double rate,
+                                             std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    const std::size_t n = std::distance(begin, end);
+    const std::size_t stride = rate > 0 ? (std::size_t) std::ceil(sample_run / rate) : 0;
+    if (rate >= 1 || stride == 0 || n < 2*stride)
+        return compute_frequencies<T>(begin, end, mr);
+
+    FrequencyMap<T> freqs(mr);
+    for (std::size_t o = 0; o + sample_run <= n; o += stride)
+    {
+        iter_t it = begin + o;
+        for (std::size_t i = 0; i < sample_run; ++i, ++it)
+            freqs[*it]++;
+    }
+
+    const U64 scale = stride / sample_run;
+    for (auto& keyval : freqs)
+        keyval.second *= scale;
+
+    // give unsampled byte values a code too
+    if (sizeof(T) == 1)
+    {
+        for (int x = 0; x < 256; ++x)
+        {
+            T t = (T) x;
+            if (freqs.find(t) == freqs.end())
+                freqs[t] = 1;
+        }
+    }
+
+    return freqs;
+}
+
+/// The codes of the symbols missed by a sample, below an escape prefix.
+template <class T>
+class EscapeCodes
+{
+public:
+
+    /// Reserve an escape prefix in the table by splitting the code of the
+    /// rarest symbol of the sample it was built from, which must not be
+    /// empty.
+    EscapeCodes (Table<T>& table, const FrequencyMap<T>& freqs)
+        : escape(table.get_allocator()), depth(0), used(0)
+    {
+        auto rarest = freqs.begin();
+        for (auto it = freqs.begin(); it != freqs.end(); ++it)
+            if (it->second < rarest->second)
+                rarest = it;
+        Bitseq& code = table.find(rarest->first)->second;
+        escape = code;
+        code.push_bit(0);
+        escape.push_bit(1);
+    }
+
+    /// Return a new code for a symbol missed by the sample.
+    /// Throw std::length_error if the code is too long for a HEF header.
+    Bitseq next_code ()
+    {
+        if (used + 1 == (U64(1) << depth)) // the block is full, or no block yet
+        {
+            // the last code of the block is the prefix of the next block
+            for (unsigned i = 0; i < depth; ++i)
+                escape.push_bit(1);
+            depth = depth == 0 ? 1 : std::min(2*depth, 32u);
+            used = 0;
+        }
+        if (escape.size() + depth > 255)
+            throw std::length_error("too many symbols missed by the sample");
+        Bitseq code(escape, escape.get_allocator());
+        for (unsigned i = depth; i-- > 0; )
+            code.push_bit((used >> i) & 1);
+        used++;
+        return code;
+    }
+
+private:
+
+    Bitseq escape;  // prefix of the current block
+    unsigned depth; // number of bits below the prefix
+    U64 used;       // number of codes of the block given out
+};
+
+/// Encode the sequence with a table built from the sampled frequencies.
+/// Symbols without a code are given one below an escape prefix and added to
+/// the table. Return the number of such symbols.
+template <class T, class iter_t>
+std::size_t encode_seq_escaped (iter_t begin, const iter_t& end,
+                                const FrequencyMap<T>& freqs, Table<T>& table,
+                                Bitseq& seq)
+{
+    if (sizeof(T) == 1) // every byte value has a code
+    {
+        seq = encode_seq<T,iter_t>::encode(begin, end, table);
+        return 0;
+    }
+    // a single sampled symbol keeps its empty code until a symbol is missed;
+    // the symbols before then are all that one, and get one bit each
+    std::optional<EscapeCodes<T>> escapes;
+    if (table.size() > 1)
+        escapes.emplace(table, freqs);
+    std::size_t missed = 0;
+    for (std::size_t i = 0; begin != end; ++begin, ++i)
+    {
+        auto it = table.find(*begin);
+        if (it == table.end())
+        {
+            if (!escapes)
+            {
+                escapes.emplace(table, freqs);
+                for (std::size_t left = i; left > 0; left -= std::min<std::size_t>(left, bpp))
+                    seq.push_bits(0, std::min<std::size_t>(left, bpp));
+            }
+            it = table.emplace(*begin, escapes->next_code()).first;
+            missed++;
+        }
+        seq.push_seq(it->second);
+    }
+    return missed;
+}
+
+/// Return the number of bits needed to encode the frequencies with the table.
+template <class T>
+std::size_t encoded_bits (const FrequencyMap<T>& freqs, const Table<T>& table)
+{
+    std::size_t bits = 0;
+    for (const auto& keyval : freqs)
+        bits += (std::size_t) keyval.second * table.find(keyval.first)->second.size();
+    return bits;
+}
+
+/// Encode the sequence using a Huffman tree built from a sample of 'rate' of
+/// its elements. The iterators must be random access.
+/// If 'stats' is not null, it receives the ratio loss against a full
+/// histogram; computing it costs the full counting pass that sampling
+/// avoids, so only request it to tune the rate.
+/// All the memory used by the call, including the returned blob, is
+/// allocated from 'mr'.
+template <class T, class iter_t>
+BinaryBlob encode_sampled (iter_t begin, const iter_t& end, double rate,
+                           SampleStats* stats = nullptr,
+                           std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+{
+    FrequencyMap<T> sampled = compute_sampled_frequencies<T>(begin, end, rate, mr);
+    Table<T> table = HuffmanTree<T>(sampled, mr).make_table();
+    Bitseq code(mr);
+    std::size_t missed = encode_seq_escaped(begin, end, sampled, table, code);
+
+    if (stats)
+    {
+        FrequencyMap<T> freqs = compute_frequencies<T>(begin, end, mr);
+        Table<T> optimal = HuffmanTree<T>(freqs, mr).make_table();
+        stats->sampled_bits = code.size();
+        stats->optimal_bits = encoded_bits(freqs, optimal);
+        stats->missed = missed;
+    }
+
+    std::size_t num_symbols = std::distance(begin, end);
+    return serialise<T>(table, num_symbols, code);
+}
+
+} // namespace kxh
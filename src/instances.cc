@@ -0,0 +1,11 @@
+// Explicit instantiations of the kxhuffman library.
+// See kxhuffman/instances.h for the list.
+
+#include <kxhuffman/huffman.h>
+
+namespace kxh
+{
+
+KXH_INSTANTIATE_ALL()
+
+} // namespace kxh
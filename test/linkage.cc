@@ -0,0 +1,19 @@
+// A second translation unit including the library: the headers must not
+// define non-inline functions.
+
+#include <boost/test/unit_test.hpp>
+
+#include <kxhuffman/huffman.h>
+
+#include <string>
+
+using namespace kxh;
+
+BOOST_AUTO_TEST_CASE(multiple_translation_units)
+{
+    const std::string data = "the library links from more than one translation unit";
+    BinaryBlob blob = encode<char>(data.begin(), data.end());
+    std::string out;
+    decode<char>(blob, out);
+    BOOST_CHECK_EQUAL(out, data);
+}
@@ -2,6 +2,17 @@
 #include <boost/test/unit_test.hpp>
 
 #include <kxhuffman/Bitseq.h>
+#include <kxhuffman/huffman.h>
+
+#include <string>
+#include <sstream>
+#include <iterator>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <limits>
+#include <thread>
 
 using namespace kxh;
 
@@ -272,3 +283,937 @@ BOOST_AUTO_TEST_CASE(bitseq_full_push_pop)
         equal(a, b);
     }
 }
+
+BOOST_AUTO_TEST_CASE(bitseq_push_bits)
+{
+    Bitseq a = create(bpp-3);
+    Bitseq b = a;
+    b.push_bits(0x2D, 6); // 101101, crosses the block boundary
+    b.push_bits(0x1, 1);
+    contains(b, a, 0);
+    contains(b, from_block(0xB600000000000000, 7), bpp-3);
+    BOOST_REQUIRE_EQUAL(b.size(), bpp+4);
+}
+
+BOOST_AUTO_TEST_CASE(huffman_encode_decode)
+{
+    std::string data = "this is an example of a huffman tree";
+    BinaryBlob blob = kxh::encode<char>(data.begin(), data.end());
+    std::string decoded;
+    kxh::decode<char>(blob, decoded);
+    BOOST_REQUIRE_EQUAL(decoded, data);
+}
+
+BOOST_AUTO_TEST_CASE(huffman_decode_preallocated)
+{
+    std::string data = "abracadabra";
+    BinaryBlob blob = kxh::encode<char>(data.begin(), data.end());
+    BOOST_REQUIRE_EQUAL(kxh::decoded_size<char>(blob), data.size());
+
+    std::vector<char> out(data.size());
+    BOOST_REQUIRE_EQUAL(kxh::decode<char>(blob, &out[0], out.size()), data.size());
+    BOOST_REQUIRE_EQUAL(std::string(out.begin(), out.end()), data);
+
+    BOOST_CHECK_THROW(kxh::decode<char>(blob, &out[0], out.size()-1), std::length_error);
+}
+
+BOOST_AUTO_TEST_CASE(huffman_encode_decode_single_symbol)
+{
+    std::string data(100, 'x');
+    BinaryBlob blob = kxh::encode<char>(data.begin(), data.end());
+    std::string decoded;
+    kxh::decode<char>(blob, decoded);
+    BOOST_REQUIRE_EQUAL(decoded, data);
+}
+
+constexpr U8 static_lengths[4] = {2, 1, 3, 3};
+constexpr StaticCode<4> static_code(static_lengths);
+
+// the code tables are computed at compile time
+static_assert(static_code.code(1) == 0x0 && static_code.length(1) == 1, "");
+static_assert(static_code.code(0) == 0x2 && static_code.length(0) == 2, "");
+static_assert(static_code.code(2) == 0x6 && static_code.length(2) == 3, "");
+static_assert(static_code.code(3) == 0x7 && static_code.length(3) == 3, "");
+
+BOOST_AUTO_TEST_CASE(static_code_encode_decode)
+{
+    std::vector<U8> data = {1, 0, 2, 3, 1, 1, 3, 0, 2};
+    BinaryBlob blob = kxh::encode(static_code, data.begin(), data.end());
+    // 1 data bit count byte pair, 1 remaining bit count byte, 3 bytes of data
+    BOOST_REQUIRE_EQUAL(blob.size(), 2 + 1 + 3);
+
+    std::vector<U8> decoded;
+    kxh::decode<U8>(static_code, blob, decoded);
+    BOOST_REQUIRE(decoded == data);
+
+    // symbols outside the alphabet, and symbols with no code
+    std::vector<U8> outside = {1, 4};
+    BOOST_CHECK_THROW(kxh::encode(static_code, outside.begin(), outside.end()),
+                      std::invalid_argument);
+    constexpr U8 partial_lengths[3] = {1, 0, 1};
+    constexpr StaticCode<3> partial_code(partial_lengths);
+    std::vector<U8> uncoded = {0, 2, 1};
+    BOOST_CHECK_THROW(kxh::encode(partial_code, uncoded.begin(), uncoded.end()),
+                      std::invalid_argument);
+}
+
+struct text_frequencies
+{
+    U64 freqs[256] = {};
+    constexpr text_frequencies () {
+        freqs[' '] = 200;
+        freqs['e'] = 120;
+        freqs['t'] = 90;
+        freqs['a'] = 80;
+        freqs['z'] = 1;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(static_code_from_frequencies)
+{
+    constexpr text_frequencies text;
+    constexpr auto code = StaticCode<256>::from_frequencies(text.freqs);
+    static_assert(code.length(' ') == 1, "");
+    static_assert(code.length('z') == code.max_length(), "");
+
+    std::string data = "eat a tea at ze tate";
+    BinaryBlob blob = kxh::encode(code, data.begin(), data.end());
+    std::string decoded;
+    kxh::decode<char>(code, blob, decoded);
+    BOOST_REQUIRE_EQUAL(decoded, data);
+}
+
+BOOST_AUTO_TEST_CASE(adaptive_encode_decode_stream)
+{
+    std::string data;
+    for (int i = 0; i < 20000; ++i)
+        data += "the quick brown fox jumps over the lazy dog "[(i*i + i/7) % 44];
+
+    // encode and decode through single-pass stream iterators
+    std::istringstream in(data);
+    std::ostringstream encoded;
+    adaptive_encode<char>(std::istreambuf_iterator<char>(in),
+                          std::istreambuf_iterator<char>(),
+                          std::ostreambuf_iterator<char>(encoded), 1024);
+    BOOST_REQUIRE_LT(encoded.str().size(), data.size());
+
+    std::istringstream encoded_in(encoded.str());
+    std::string decoded;
+    adaptive_decode<char>(std::istreambuf_iterator<char>(encoded_in),
+                          std::istreambuf_iterator<char>(),
+                          std::back_inserter(decoded));
+    BOOST_REQUIRE_EQUAL(decoded, data);
+}
+
+BOOST_AUTO_TEST_CASE(adaptive_encode_decode_wide_symbols)
+{
+    std::vector<U32> data;
+    for (U32 i = 0; i < 5000; ++i)
+        data.push_back((i * 2654435761u) % 1000 < 900 ? i % 3 : i);
+
+    BinaryBlob blob = adaptive_encode<U32>(data.begin(), data.end());
+    std::vector<U32> decoded;
+    adaptive_decode<U32>(blob, decoded);
+    BOOST_REQUIRE(decoded == data);
+
+    std::vector<U32> empty, decoded_empty;
+    blob = adaptive_encode<U32>(empty.begin(), empty.end());
+    adaptive_decode<U32>(blob, decoded_empty);
+    BOOST_REQUIRE(decoded_empty.empty());
+}
+
+BOOST_AUTO_TEST_CASE(sampled_encode_decode)
+{
+    // skewed bytes, plus a rare byte the sample is unlikely to see
+    std::string data;
+    for (std::size_t i = 0; i < 200000; ++i)
+        data += "aaaabbbccd"[(i * 7919) % 10];
+    data[123457] = 'z';
+
+    SampleStats stats;
+    BinaryBlob blob = encode_sampled<char>(data.begin(), data.end(), 0.01, &stats);
+    std::string decoded;
+    kxh::decode<char>(blob, decoded);
+    BOOST_REQUIRE_EQUAL(decoded, data);
+    BOOST_REQUIRE_EQUAL(stats.missed, 0u);
+    BOOST_REQUIRE_GE(stats.sampled_bits, stats.optimal_bits);
+    BOOST_REQUIRE_LT(stats.ratio_loss(), 0.05);
+}
+
+BOOST_AUTO_TEST_CASE(sampled_encode_decode_escape)
+{
+    std::vector<U16> data(100000, 1);
+    for (std::size_t i = 0; i < data.size(); i += 3)
+        data[i] = 2;
+    data[50001] = 999; // missed by the sample
+
+    SampleStats stats;
+    BinaryBlob blob = encode_sampled<U16>(data.begin(), data.end(), 0.01, &stats);
+    std::vector<U16> decoded;
+    kxh::decode<U16>(blob, decoded);
+    BOOST_REQUIRE(decoded == data);
+    BOOST_REQUIRE_EQUAL(stats.missed, 1u);
+    BOOST_REQUIRE_LT(stats.ratio_loss(), 0.01);
+
+    // enough missed symbols to fill several blocks of escaped codes, some of
+    // them more than once
+    for (std::size_t i = 0; i < 3000; ++i)
+        data[(i * 7919) % data.size()] = (U16) (1000 + i % 2000);
+    blob = encode_sampled<U16>(data.begin(), data.end(), 0.01, &stats);
+    decoded.clear();
+    kxh::decode<U16>(blob, decoded);
+    BOOST_REQUIRE(decoded == data);
+    BOOST_REQUIRE_GT(stats.missed, 1000u);
+    BOOST_REQUIRE_LE(stats.missed, 2001u);
+
+    // a single sampled symbol, whose code is split at the first miss
+    std::vector<U32> same(100000, 7);
+    same[70000] = 8;
+    same[90000] = 9;
+    BinaryBlob one = encode_sampled<U32>(same.begin(), same.end(), 0.01, &stats);
+    std::vector<U32> decoded_same;
+    kxh::decode<U32>(one, decoded_same);
+    BOOST_REQUIRE(decoded_same == same);
+    BOOST_REQUIRE_EQUAL(stats.missed, 2u);
+    // 99998 sevens of 1 bit, then 10 and 1100 below the escape 1
+    BOOST_REQUIRE_EQUAL(stats.sampled_bits, 99998u + 2u + 4u);
+}
+
+BOOST_AUTO_TEST_CASE(indexed_decode_range)
+{
+    std::vector<U16> data;
+    for (U16 i = 0; i < 10000; ++i)
+        data.push_back((i * 37) % 101);
+
+    BinaryBlob indexed = encode_indexed<U16>(data.begin(), data.end(), 64);
+    BinaryBlob plain = kxh::encode<U16>(data.begin(), data.end());
+    BOOST_REQUIRE_EQUAL(indexed.size(), plain.size() + 2 + 8*((data.size()-1)/64));
+
+    // the index does not change regular decoding
+    std::vector<U16> decoded;
+    kxh::decode<U16>(indexed, decoded);
+    BOOST_REQUIRE(decoded == data);
+
+    const std::size_t ranges[][2] = { {0, 10}, {63, 2}, {64, 64}, {5000, 100},
+                                      {9990, 10}, {10000, 0}, {0, 10000} };
+    const EncodedView<U16> indexed_view(indexed), plain_view(plain);
+    for (const auto& r : ranges)
+    {
+        for (const BinaryBlob* blob : { &indexed, &plain })
+        {
+            std::vector<U16> range;
+            decode_range<U16>(*blob, r[0], r[1], std::back_inserter(range));
+            BOOST_REQUIRE(std::equal(range.begin(), range.end(), data.begin() + r[0],
+                                     data.begin() + r[0] + r[1]));
+        }
+        for (const EncodedView<U16>* view : { &indexed_view, &plain_view })
+        {
+            std::vector<U16> range(r[1]);
+            BOOST_REQUIRE(view->decode_range(r[0], r[1], range.begin()) == range.end());
+            BOOST_REQUIRE(std::equal(range.begin(), range.end(), data.begin() + r[0]));
+        }
+    }
+
+    std::vector<U16> range;
+    BOOST_CHECK_THROW(decode_range<U16>(indexed, 9990, 11, std::back_inserter(range)),
+                      std::out_of_range);
+    BOOST_CHECK_THROW(indexed_view.decode_range(9990, 11, std::back_inserter(range)),
+                      std::out_of_range);
+}
+
+BOOST_AUTO_TEST_CASE(lsb_encode_decode)
+{
+    std::string data;
+    for (int i = 0; i < 50000; ++i)
+        data += (char) ((i * i) % 251 < 200 ? (i % 7) * 37 : i % 256);
+
+    BinaryBlob lsb = encode_lsb<char>(data.begin(), data.end());
+    BinaryBlob msb = kxh::encode<char>(data.begin(), data.end());
+    BOOST_REQUIRE_EQUAL(lsb.size(), msb.size());
+    BOOST_REQUIRE_EQUAL(lsb[0] & hef_lsb, hef_lsb);
+
+    std::string decoded;
+    kxh::decode<char>(lsb, decoded);
+    BOOST_REQUIRE_EQUAL(decoded, data);
+
+    std::string range;
+    decode_range<char>(lsb, 31000, 500, std::back_inserter(range));
+    BOOST_REQUIRE_EQUAL(range, data.substr(31000, 500));
+
+    std::vector<U32> wide;
+    for (U32 i = 0; i < 3000; ++i)
+        wide.push_back(i % 17 == 0 ? i : i % 5);
+    std::vector<U32> wide_decoded;
+    kxh::decode<U32>(encode_lsb<U32>(wide.begin(), wide.end()), wide_decoded);
+    BOOST_REQUIRE(wide_decoded == wide);
+}
+
+BOOST_AUTO_TEST_CASE(parallel_encode_identical)
+{
+    std::string data;
+    for (int i = 0; i < 300000; ++i)
+        data += (char) ((i * 31) % 97 < 60 ? 'a' + i % 5 : (i * 7) % 256);
+
+    BinaryBlob serial = kxh::encode<char>(data.begin(), data.end());
+    for (std::size_t threads : { 1, 2, 3, 7, 16 })
+    {
+        BinaryBlob parallel = encode_parallel<char>(data.begin(), data.end(), threads);
+        BOOST_REQUIRE(parallel == serial);
+    }
+
+    std::vector<U32> wide;
+    for (U32 i = 0; i < 100000; ++i)
+        wide.push_back(i % 13 == 0 ? i : i % 4);
+    BOOST_REQUIRE(encode_parallel<U32>(wide.begin(), wide.end(), 5)
+                  == kxh::encode<U32>(wide.begin(), wide.end()));
+}
+
+BOOST_AUTO_TEST_CASE(executors)
+{
+    ThreadPool pool(4);
+    InlineExecutor serial;
+    for (Executor* executor : { (Executor*) &pool, (Executor*) &serial })
+    {
+        // every iteration runs once, also from tasks of the same executor
+        std::vector<std::atomic<int>> hits(64 * 64);
+        executor->parallel_for(64, [&] (std::size_t i) {
+            executor->parallel_for(64, [&] (std::size_t j) { hits[i*64 + j]++; });
+        });
+        BOOST_CHECK(std::all_of(hits.begin(), hits.end(), [] (const std::atomic<int>& h) {
+            return h == 1;
+        }));
+
+        BOOST_CHECK_THROW(executor->parallel_for(10, [] (std::size_t i) {
+            if (i == 7) throw std::runtime_error("iteration failed");
+        }), std::runtime_error);
+
+        std::string data;
+        for (int i = 0; i < 300000; ++i)
+            data += (char) ((i * 31) % 97 < 60 ? 'a' + i % 5 : (i * 7) % 256);
+        BOOST_CHECK(encode_parallel<char>(data.begin(), data.end(), *executor)
+                    == kxh::encode<char>(data.begin(), data.end()));
+
+        BinaryBlob indexed = encode_indexed<char>(data.begin(), data.end(), 1000);
+        std::string decoded = "x";
+        decode_parallel<char>(indexed, decoded, *executor);
+        BOOST_CHECK(decoded == "x" + data);
+        decoded.clear();
+        decode_parallel<char>(kxh::encode<char>(data.begin(), data.end()), decoded, *executor);
+        BOOST_CHECK(decoded == data);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(block_encoder_reuse)
+{
+    // a steady stream, then a shift to a different distribution
+    auto make_block = [] (int seed, bool shifted) {
+        std::string block;
+        for (int i = 0; i < 20000; ++i)
+        {
+            int r = (i * 7919 + seed * 104729) % 100;
+            if (shifted) block += r < 70 ? 'z' : r < 90 ? 'y' : 'a' + r % 5;
+            else         block += r < 40 ? 'a' : r < 70 ? 'b' : 'c' + r % 4;
+        }
+        return block;
+    };
+
+    BlockEncoder<char> encoder;
+    std::vector<std::string> blocks;
+    for (int i = 0; i < 10; ++i)
+        blocks.push_back(make_block(i, false));
+    std::size_t steady_rebuilds = 0;
+    for (std::size_t i = 0; i < blocks.size(); ++i)
+    {
+        BinaryBlob blob = encoder.encode(blocks[i].begin(), blocks[i].end());
+        std::string out;
+        kxh::decode<char>(blob, out);
+        BOOST_REQUIRE_EQUAL(out, blocks[i]);
+        steady_rebuilds = encoder.rebuilds();
+    }
+    BOOST_CHECK_EQUAL(steady_rebuilds, 1u);
+
+    // new symbols force a rebuild, and the code follows the new statistics
+    for (int i = 0; i < 10; ++i)
+    {
+        std::string block = make_block(i, true);
+        BinaryBlob blob = encoder.encode(block.begin(), block.end());
+        std::string out;
+        kxh::decode<char>(blob, out);
+        BOOST_REQUIRE_EQUAL(out, block);
+    }
+    BOOST_CHECK_GT(encoder.rebuilds(), steady_rebuilds);
+    BOOST_CHECK_LT(encoder.rebuilds(), 10u);
+    BOOST_CHECK_EQUAL(encoder.blocks(), 20u);
+    BOOST_CHECK_EQUAL(encoder.code_table().find('z')->second.size(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(lazy_decode_range)
+{
+    std::string data;
+    for (int i = 0; i < 20000; ++i)
+        data += (char) ((i * 13) % 29 < 20 ? 'a' + i % 3 : i % 128);
+
+    BinaryBlob blob = kxh::encode<char>(data.begin(), data.end());
+    DecodedRange<char> range = decode_lazy<char>(blob);
+    BOOST_REQUIRE_EQUAL(range.size(), data.size());
+
+    std::string decoded;
+    for (char c : range)
+        decoded += c;
+    BOOST_REQUIRE_EQUAL(decoded, data);
+
+    BOOST_CHECK(std::equal(range.begin(), range.end(), data.begin(), data.end()));
+    BOOST_CHECK_EQUAL(std::count(range.begin(), range.end(), 'b'),
+                      std::count(data.begin(), data.end(), 'b'));
+    auto it = std::find(range.begin(), range.end(), (char) 100);
+    BOOST_CHECK_EQUAL(std::distance(range.begin(), it),
+                      (std::ptrdiff_t) data.find((char) 100));
+
+    // LSB-first blobs, and a single symbol, whose code is empty
+    BinaryBlob lsb = encode_lsb<char>(data.begin(), data.end());
+    DecodedRange<char> lsb_range = decode_lazy<char>(lsb);
+    BOOST_CHECK(std::equal(lsb_range.begin(), lsb_range.end(), data.begin(), data.end()));
+
+    std::vector<U16> single(100, 7);
+    BinaryBlob single_blob = kxh::encode<U16>(single.begin(), single.end());
+    DecodedRange<U16> single_range = decode_lazy<U16>(single_blob);
+    BOOST_CHECK(std::equal(single_range.begin(), single_range.end(), single.begin(), single.end()));
+}
+
+BOOST_AUTO_TEST_CASE(decode_cache_reuse)
+{
+    auto make_block = [] (int seed, int alphabet) {
+        std::string block;
+        for (int i = 0; i < 5000; ++i)
+        {
+            int r = (i * 7919 + seed * 104729) % 100;
+            block += (char) ('a' + (r < 50 ? 0 : r % alphabet));
+        }
+        return block;
+    };
+
+    // blocks sharing a table hit the cache
+    BlockEncoder<char> encoder;
+    std::vector<std::string> blocks;
+    std::vector<BinaryBlob> blobs;
+    for (int i = 0; i < 8; ++i)
+    {
+        blocks.push_back(make_block(i, 7));
+        blobs.push_back(encoder.encode(blocks.back().begin(), blocks.back().end()));
+    }
+    BOOST_REQUIRE_EQUAL(encoder.rebuilds(), 1u);
+
+    DecodeCache<char> cache(2);
+    for (std::size_t i = 0; i < blobs.size(); ++i)
+    {
+        std::string out;
+        kxh::decode<char>(blobs[i], out, cache);
+        BOOST_REQUIRE_EQUAL(out, blocks[i]);
+    }
+    BOOST_CHECK_EQUAL(cache.misses(), 1u);
+    BOOST_CHECK_EQUAL(cache.hits(), blobs.size() - 1);
+
+    // three tables in a cache of two: the least recently used is evicted
+    std::vector<std::string> texts = { make_block(0, 3), make_block(0, 5), make_block(0, 11) };
+    cache.clear();
+    for (int round = 0; round < 2; ++round)
+    {
+        for (const std::string& text : texts)
+        {
+            std::string out;
+            kxh::decode<char>(kxh::encode<char>(text.begin(), text.end()), out, cache);
+            BOOST_REQUIRE_EQUAL(out, text);
+        }
+    }
+    BOOST_CHECK_EQUAL(cache.size(), 2u);
+    BOOST_CHECK_EQUAL(cache.hits(), 0u);
+    BOOST_CHECK_EQUAL(cache.misses(), 6u);
+
+    // indexed blobs, and concurrent decoding through the process-wide cache
+    BinaryBlob indexed = encode_indexed<char>(blocks[0].begin(), blocks[0].end(), 100);
+    std::vector<std::thread> threads;
+    std::atomic<int> failures(0);
+    for (int t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 50; ++i)
+            {
+                std::string out;
+                kxh::decode<char>(indexed, out, shared_decode_cache<char>());
+                if (out != blocks[0]) failures++;
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+    BOOST_CHECK_EQUAL(failures, 0);
+    BOOST_CHECK_GE(shared_decode_cache<char>().hits(), 196u);
+}
+
+BOOST_AUTO_TEST_CASE(encoded_view_queries)
+{
+    // a skewed alphabet wide enough for codes longer than the lookup table
+    std::vector<U32> data;
+    for (U32 i = 0; i < 60000; ++i)
+    {
+        U32 r = (i * 2654435761u) >> 20;
+        data.push_back(r % 8 ? r % 5 : 100 + r % 3000);
+    }
+    const std::vector<U32> pattern = { data[41000], data[41001], data[41002], data[41003] };
+    const std::size_t first = std::search(data.begin(), data.end(),
+                                          pattern.begin(), pattern.end()) - data.begin();
+
+    for (const BinaryBlob& blob : { kxh::encode<U32>(data.begin(), data.end()),
+                                    encode_lsb<U32>(data.begin(), data.end()),
+                                    encode_indexed<U32>(data.begin(), data.end(), 1000) })
+    {
+        EncodedView<U32> view(blob);
+        BOOST_REQUIRE_EQUAL(view.size(), data.size());
+        for (U32 x : { 0u, 3u, 100u + 17u, 99999u })
+            BOOST_CHECK_EQUAL(view.count(x), (std::size_t) std::count(data.begin(), data.end(), x));
+
+        std::vector<std::size_t> positions;
+        view.find_all(data[123], std::back_inserter(positions));
+        std::vector<std::size_t> expected;
+        for (std::size_t i = 0; i < data.size(); ++i)
+            if (data[i] == data[123]) expected.push_back(i);
+        BOOST_CHECK(positions == expected);
+
+        BOOST_CHECK_EQUAL(view.search(pattern.begin(), pattern.end()), first);
+        const std::vector<U32> missing = { 0, 99999 };
+        BOOST_CHECK_EQUAL(view.search(missing.begin(), missing.end()), data.size());
+
+        FrequencyMap<U32> hist = view.histogram(25000, 12345);
+        FrequencyMap<U32> expected_hist = compute_frequencies<U32>(data.begin() + 25000,
+                                                                   data.begin() + 37345);
+        BOOST_CHECK(hist == expected_hist);
+        BOOST_CHECK_THROW(view.histogram(59000, 1001), std::out_of_range);
+    }
+
+    std::string single(1000, 'q');
+    BinaryBlob single_blob = kxh::encode<char>(single.begin(), single.end());
+    EncodedView<char> single_view(single_blob);
+    BOOST_CHECK_EQUAL(single_view.count('q'), 1000u);
+    BOOST_CHECK_EQUAL(single_view.search(single.begin(), single.begin() + 10), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(cpu_dispatch_kernels)
+{
+    std::string data;
+    for (int i = 0; i < 100000; ++i)
+        data += (char) ((i * 2654435761u >> 11) % 23 < 15 ? 'a' + i % 4 : (i * 7) % 256);
+
+    const cpu_level host = detect_cpu_level();
+    BOOST_CHECK_THROW(kernel_table((cpu_level) (cpu_avx2 + 1)), std::invalid_argument);
+
+    select_kernels(cpu_baseline);
+    const BinaryBlob msb = kxh::encode<char>(data.begin(), data.end());
+    const BinaryBlob lsb = encode_lsb<char>(data.begin(), data.end());
+
+    // every level the host supports produces the same output
+    for (int level = cpu_baseline; level <= host; ++level)
+    {
+        select_kernels((cpu_level) level);
+        BOOST_TEST_MESSAGE("kernels: " << kernels().name);
+
+        BOOST_REQUIRE(kxh::encode<char>(data.begin(), data.end()) == msb);
+        BOOST_REQUIRE(kxh::encode<char>(data.data(), data.data() + data.size()) == msb);
+        BOOST_REQUIRE(encode_lsb<char>(data.begin(), data.end()) == lsb);
+
+        for (const BinaryBlob* blob : { &msb, &lsb })
+        {
+            std::string decoded;
+            kxh::decode<char>(*blob, decoded);
+            BOOST_REQUIRE_EQUAL(decoded, data);
+            std::string range;
+            decode_range<char>(*blob, 1234, 5000, std::back_inserter(range));
+            BOOST_CHECK(range == data.substr(1234, 5000));
+        }
+
+        EncodedView<char> view(lsb);
+        BOOST_CHECK_EQUAL(view.count('c'), (std::size_t) std::count(data.begin(), data.end(), 'c'));
+        BOOST_CHECK(view.histogram() == compute_frequencies<char>(data.begin(), data.end()));
+
+        // block stores of every length around the vector width
+        std::vector<Block> blocks;
+        for (Block b = 0; b < 12; ++b)
+            blocks.push_back(b * 0x9E3779B97F4A7C15ull);
+        for (std::size_t num_bits = 0; num_bits <= 11 * (std::size_t) bpp; num_bits += 13)
+        {
+            std::vector<U8> expected((num_bits+7)/8 + 1, 0xAA), stored(expected);
+            kernel_table(cpu_baseline).store_blocks(blocks.data(), num_bits, expected.data());
+            kernels().store_blocks(blocks.data(), num_bits, stored.data());
+            BOOST_CHECK(stored == expected);
+        }
+    }
+    select_kernels(host);
+}
+
+BOOST_AUTO_TEST_CASE(pair_table_encode)
+{
+    // an odd number of bytes with short codes, then with codes whose pairs
+    // are too long for the pair table
+    std::string data;
+    for (int i = 0; i < 100001; ++i)
+        data += (char) ('a' + (i * 2654435761u >> 9) % 11);
+    // symbol k occurs 2^(16-k) times: the rarest codes are 16 bits long
+    std::string skewed;
+    for (int k = 0; k <= 16; ++k)
+        skewed.append(std::size_t(1) << (16 - k), (char) ('A' + k));
+    std::rotate(skewed.begin(), skewed.begin() + skewed.size() / 3, skewed.end());
+
+    for (const std::string* text : { &data, &skewed })
+    {
+        using seq_encoder = encode_seq<char, std::string::const_iterator>;
+        HuffmanTree<char> tree(text->begin(), text->end());
+        Table<char> table = tree.make_table();
+        BOOST_CHECK(seq_encoder::use_pairs(table, text->size()));
+
+        Bitseq expected;
+        for (char c : *text)
+            expected.push_seq(table.find(c)->second);
+        Bitseq code = seq_encoder::encode(text->cbegin(), text->cend(), table);
+        BOOST_REQUIRE_EQUAL(code.size(), expected.size());
+        std::size_t mismatches = 0;
+        for (std::size_t i = 0; i < code.size(); ++i)
+            mismatches += code[i] != expected[i];
+        BOOST_CHECK_EQUAL(mismatches, 0u);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(long_codes_encode)
+{
+    // Fibonacci counts make a maximally skewed tree: 80 symbols give codes
+    // up to 79 bits, longer than a block
+    FrequencyMap<char> freqs;
+    U64 a = 1, b = 1;
+    for (int k = 0; k < 80; ++k)
+    {
+        freqs[(char) k] = a;
+        U64 c = a + b;
+        a = b;
+        b = c;
+    }
+    Table<char> table = HuffmanTree<char>(freqs).make_table();
+    std::size_t max_length = 0;
+    for (const auto& keyval : table)
+        max_length = std::max(max_length, keyval.second.size());
+    BOOST_REQUIRE_EQUAL(max_length, 79u);
+
+    std::string data;
+    for (int i = 0; i < 1000; ++i)
+        data += (char) (79 - i % 80);
+    Bitseq expected;
+    for (char c : data)
+        expected.push_seq(table.find(c)->second);
+    Bitseq code = encode_seq<char, std::string::iterator>::encode(data.begin(), data.end(), table);
+    BOOST_REQUIRE_EQUAL(code.size(), expected.size());
+    std::size_t mismatches = 0;
+    for (std::size_t i = 0; i < code.size(); ++i)
+        mismatches += code[i] != expected[i];
+    BOOST_CHECK_EQUAL(mismatches, 0u);
+
+    std::string decoded;
+    decode<char>(serialise<char>(table, data.size(), code), decoded);
+    BOOST_CHECK(decoded == data);
+}
+
+BOOST_AUTO_TEST_CASE(decode_image_roundtrip)
+{
+    // symbol k occurs 2^(12-k) times, so that some codes are longer than the
+    // lookup table
+    std::string data;
+    for (int k = 0; k <= 12; ++k)
+        data.append(std::size_t(1) << (12 - k), (char) ('A' + k));
+    std::rotate(data.begin(), data.begin() + data.size() / 3, data.end());
+
+    HuffmanTree<char> tree(data.begin(), data.end());
+    Table<char> table = tree.make_table();
+    Bitseq code = encode_seq<char, std::string::iterator>::encode(data.begin(), data.end(), table);
+    BinaryBlob blob = serialise<char>(table, data.size(), code);
+    BinaryBlob lsb = encode_lsb<char>(data.begin(), data.end());
+
+    for (const BinaryBlob& image_bytes : { build_decode_image<char>(table),
+                                           build_decode_image<char>(table, false, 4),
+                                           build_decode_image<char>(lsb) })
+    {
+        // an 8-byte aligned copy, as from mmap
+        std::vector<U64> storage(image_bytes.size() / 8);
+        memcpy(storage.data(), image_bytes.data(), image_bytes.size());
+        DecodeImage<char> image(storage.data(), image_bytes.size());
+        BOOST_CHECK_EQUAL(image.size(), table.size());
+
+        std::string out = "x";
+        decode(image.lsb() ? lsb : blob, out, image);
+        BOOST_CHECK(out == "x" + data);
+        BOOST_CHECK_THROW(decode(image.lsb() ? blob : lsb, out, image), std::invalid_argument);
+
+        BOOST_CHECK_THROW(DecodeImage<U16>(storage.data(), image_bytes.size()),
+                          std::invalid_argument);
+        BOOST_CHECK_THROW(DecodeImage<char>((const U8*) storage.data() + 1, image_bytes.size() - 8),
+                          std::invalid_argument);
+        ((U8*) storage.data())[image_bytes.size() - 1] ^= 1;
+        BOOST_CHECK_THROW(DecodeImage<char>(storage.data(), image_bytes.size()),
+                          std::runtime_error);
+        BOOST_CHECK_NO_THROW(DecodeImage<char>(storage.data(), image_bytes.size(), false));
+    }
+
+    // tables that do not fit in the given size
+    BinaryBlob serial = lsb.substr(1);
+    const std::size_t table_size = checked_arrays_size<char>((const U8*) serial.data(), serial.size());
+    for (std::size_t size : { std::size_t(0), std::size_t(1), std::size_t(2), table_size - 1 })
+        BOOST_CHECK_THROW(build_decode_image<char>((const U8*) serial.data(), size, true),
+                          std::runtime_error);
+    BOOST_CHECK_THROW(build_decode_image<char>(lsb.substr(0, table_size)), std::runtime_error);
+
+    // a single symbol has an empty code
+    std::string same(100, 'z');
+    BinaryBlob one = encode<char>(same.begin(), same.end());
+    BinaryBlob image_bytes = build_decode_image<char>(one);
+    std::vector<U64> storage(image_bytes.size() / 8);
+    memcpy(storage.data(), image_bytes.data(), image_bytes.size());
+    std::string out;
+    decode(one, out, DecodeImage<char>(storage.data(), image_bytes.size()));
+    BOOST_CHECK(out == same);
+}
+
+BOOST_AUTO_TEST_CASE(scatter_gather)
+{
+    std::string data;
+    for (int i = 0; i < 100001; ++i)
+        data += (char) ('a' + (i * 2654435761u >> 9) % 11);
+
+    // uneven segments, including empty ones and odd lengths across the
+    // pair lookups
+    const std::size_t cuts[] = {0, 0, 1, 7, 4096, 4097, 50000, 99999, 100001};
+    std::vector<ConstBuffer> in;
+    for (std::size_t i = 0; i + 1 < sizeof(cuts) / sizeof(cuts[0]); ++i)
+        in.push_back(ConstBuffer{data.data() + cuts[i], cuts[i+1] - cuts[i]});
+
+    BOOST_CHECK(compute_frequencies<char>(in.data(), in.size())
+                == compute_frequencies<char>(data.begin(), data.end()));
+    BinaryBlob blob = kxh::encode<char>(in.data(), in.size());
+    BOOST_CHECK(blob == kxh::encode<char>(data.begin(), data.end()));
+
+    std::string a(3, 0), b(60000, 0), c(50000, 0);
+    std::vector<MutableBuffer> out = {{&a[0], a.size()}, {&b[0], b.size()}, {&c[0], c.size()}};
+    BOOST_CHECK_EQUAL(kxh::decode<char>(blob, out.data(), out.size()), data.size());
+    BOOST_CHECK((a + b + c).compare(0, data.size(), data) == 0);
+    BOOST_CHECK_THROW(kxh::decode<char>(blob, out.data(), 2), std::length_error);
+
+    BinaryBlob lsb = encode_lsb<char>(data.begin(), data.end());
+    BOOST_CHECK_EQUAL(kxh::decode<char>(lsb, out.data(), out.size()), data.size());
+    BOOST_CHECK((a + b + c).compare(0, data.size(), data) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(bucketed_integers)
+{
+    BOOST_CHECK_EQUAL(bucket_count, 136u);
+    for (U64 v : { U64(0), U64(15), U64(16), U64(23), U64(24), U64(31), U64(32), U64(1000),
+                   U64(1) << 40, ~U64(0) })
+    {
+        Bucket b = bucket_values(value_bucket(v));
+        BOOST_CHECK(v >= b.base && v - b.base < (U64(1) << b.extra));
+    }
+    BOOST_CHECK_EQUAL(value_bucket(~U64(0)), bucket_count - 1);
+
+    // sizes: mostly small, with a long tail of distinct large values
+    std::vector<U32> sizes;
+    U32 x = 12345;
+    for (int i = 0; i < 50000; ++i)
+    {
+        x = x * 1103515245 + 12345;
+        sizes.push_back(i % 4 ? (x >> 16) % 12 : x >> (x % 24));
+    }
+    BinaryBlob bucketed = encode_bucketed<U32>(sizes.begin(), sizes.end());
+    BinaryBlob plain = kxh::encode<U32>(sizes.begin(), sizes.end());
+    BOOST_CHECK_LT(bucketed.size(), plain.size());
+
+    std::vector<U32> decoded = {7};
+    decode_bucketed<U32>(bucketed, decoded);
+    BOOST_REQUIRE_EQUAL(decoded.size(), sizes.size() + 1);
+    BOOST_CHECK(std::equal(sizes.begin(), sizes.end(), decoded.begin() + 1));
+    BOOST_CHECK_THROW(kxh::decode<U32>(bucketed, decoded), std::runtime_error);
+    BOOST_CHECK_THROW(decoded_size<U32>(bucketed), std::runtime_error);
+    BOOST_CHECK_THROW(decode_bucketed<U32>(plain, decoded), std::runtime_error);
+    std::vector<U8> narrow;
+    BOOST_CHECK_THROW(decode_bucketed<U8>(bucketed, narrow), std::runtime_error);
+
+    // the full 64-bit range, and a single bucket with no code bits
+    std::vector<U64> wide = {0, 1, ~U64(0), U64(1) << 63, 123456789012345ULL, 17, 16};
+    std::vector<U64> wide_decoded;
+    decode_bucketed<U64>(encode_bucketed<U64>(wide.begin(), wide.end()), wide_decoded);
+    BOOST_CHECK(wide_decoded == wide);
+    std::vector<U16> same(1000, 40000);
+    std::vector<U16> same_decoded;
+    decode_bucketed<U16>(encode_bucketed<U16>(same.begin(), same.end()), same_decoded);
+    BOOST_CHECK(same_decoded == same);
+}
+
+BOOST_AUTO_TEST_CASE(byte_planes)
+{
+    // a random walk: a predictable high byte, a noisy low byte
+    std::vector<U16> samples;
+    U16 v = 32768;
+    U32 x = 1;
+    for (int i = 0; i < 100000; ++i)
+    {
+        x = x * 1103515245 + 12345;
+        v = (U16) (v + (int) ((x >> 16) % 33) - 16);
+        samples.push_back(v);
+    }
+    BinaryBlob planes = encode_planes<U16>(samples.begin(), samples.end());
+    BOOST_CHECK_LT(planes.size(), kxh::encode<U16>(samples.begin(), samples.end()).size());
+    BOOST_CHECK_LT(planes.size(), samples.size() * sizeof(U16));
+
+    std::vector<U16> decoded = {1};
+    decode_planes<U16>(planes, decoded);
+    BOOST_REQUIRE_EQUAL(decoded.size(), samples.size() + 1);
+    BOOST_CHECK(std::equal(samples.begin(), samples.end(), decoded.begin() + 1));
+    BOOST_CHECK_THROW(kxh::decode<U16>(planes, decoded), std::runtime_error);
+    BOOST_CHECK_THROW(decoded_size<U16>(planes), std::runtime_error);
+    std::vector<U32> wrong;
+    BOOST_CHECK_THROW(decode_planes<U32>(planes, wrong), std::runtime_error);
+
+    // floats, records with a constant byte, and no symbols at all
+    std::vector<float> floats;
+    for (int i = 0; i < 5000; ++i)
+        floats.push_back(i * 0.25f - 100);
+    std::vector<float> floats_decoded;
+    decode_planes<float>(encode_planes<float>(floats.begin(), floats.end()), floats_decoded);
+    BOOST_CHECK(floats_decoded == floats);
+
+    using Record = std::array<U8, 3>;
+    std::vector<Record> records;
+    for (int i = 0; i < 3000; ++i)
+        records.push_back(Record{{(U8) i, 7, (U8) (i % 5)}});
+    std::vector<Record> records_decoded;
+    decode_planes<Record>(encode_planes<Record>(records.begin(), records.end()), records_decoded);
+    BOOST_CHECK(records_decoded == records);
+
+    std::vector<U32> none, none_decoded;
+    decode_planes<U32>(encode_planes<U32>(none.begin(), none.end()), none_decoded);
+    BOOST_CHECK(none_decoded.empty());
+}
+
+BOOST_AUTO_TEST_CASE(run_length)
+{
+    // a sparse bitmap: long runs of zeros, short runs of flags
+    std::string bitmap;
+    U32 x = 1;
+    while (bitmap.size() < 200000)
+    {
+        x = x * 1103515245 + 12345;
+        bitmap.append(100 + (x >> 16) % 3000, '\0');
+        x = x * 1103515245 + 12345;
+        bitmap.append(1 + (x >> 16) % 20, (char) (1 + (x >> 24) % 3));
+    }
+    BinaryBlob runs = encode_runs<char>(bitmap.begin(), bitmap.end());
+    BOOST_CHECK_LT(runs.size() * 10, kxh::encode<char>(bitmap.begin(), bitmap.end()).size());
+
+    std::string decoded = "x";
+    decode_runs<char>(runs, decoded);
+    BOOST_CHECK(decoded == "x" + bitmap);
+    BOOST_CHECK_THROW(kxh::decode<char>(runs, decoded), std::runtime_error);
+    BOOST_CHECK_THROW(decoded_size<char>(runs), std::runtime_error);
+    BinaryBlob plain = kxh::encode<char>(bitmap.begin(), bitmap.end());
+    BOOST_CHECK_THROW(decode_runs<char>(plain, decoded), std::runtime_error);
+
+    // wide symbols, a single run longer than 2^16, no runs, and no symbols
+    std::vector<U16> samples;
+    for (int i = 0; i < 1000; ++i)
+        samples.insert(samples.end(), 1 + i % 7, (U16) (i * 37));
+    std::vector<U16> samples_decoded;
+    decode_runs<U16>(encode_runs<U16>(samples.begin(), samples.end()), samples_decoded);
+    BOOST_CHECK(samples_decoded == samples);
+
+    for (const std::string& s : { std::string(100000, 'a'), std::string("abcdefg"), std::string() })
+    {
+        std::string d;
+        decode_runs<char>(encode_runs<char>(s.begin(), s.end()), d);
+        BOOST_CHECK(d == s);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(large_counts)
+{
+    for (U64 n : { U64(0), U64(255), U64(256), U64(65535), U64(65536), U64(4294967295u),
+                   U64(4294967296u), U64(1) << 40, ~U64(0) })
+    {
+        BinaryBlob serial = serialise_num(n);
+        const U8* ptr = (const U8*) serial.c_str();
+        BOOST_CHECK_EQUAL(deserialise_num(ptr), n);
+        BOOST_CHECK_EQUAL(ptr - (const U8*) serial.c_str(), (std::ptrdiff_t) serial.size());
+    }
+
+    // counts above 2^31, which overflowed 32-bit weights
+    FrequencyMap<char> freqs;
+    freqs['a'] = 5000000000u;
+    freqs['b'] = 3000000000u;
+    freqs['c'] = 3000000001u;
+    freqs['d'] = 1;
+    Table<char> table = HuffmanTree<char>(freqs).make_table();
+    BOOST_CHECK_EQUAL(table['a'].size(), 1u);
+    BOOST_CHECK_EQUAL(table['c'].size(), 2u);
+    BOOST_CHECK_EQUAL(table['b'].size(), 3u);
+    BOOST_CHECK_EQUAL(table['d'].size(), 3u);
+
+    U64 total = rescale_frequencies(freqs, 65535);
+    BOOST_CHECK_LE(total, 65535u);
+    BOOST_CHECK_EQUAL(total, freqs['a'] + freqs['b'] + freqs['c'] + freqs['d']);
+    BOOST_CHECK_EQUAL(freqs['d'], 1u);
+    BOOST_CHECK(freqs['a'] >= freqs['c'] && freqs['c'] >= freqs['b']);
+    BOOST_CHECK_THROW(rescale_frequencies(freqs, 3), std::invalid_argument);
+}
+
+/// The symbols 'a' or, at every 16th position, 'b', 'c' or 'd', generated
+/// on the fly so that multi-GB inputs need no memory.
+class PatternIterator
+{
+public:
+
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = char;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const char*;
+    using reference = char;
+
+    explicit PatternIterator (U64 i = 0) : i(i) {}
+
+    char operator* () const {
+        return i % 16 ? 'a' : (char) ('b' + i / 16 % 3);
+    }
+
+    PatternIterator& operator++ () { ++i; return *this; }
+    bool operator== (const PatternIterator& that) const { return i == that.i; }
+    bool operator!= (const PatternIterator& that) const { return i != that.i; }
+
+private:
+
+    U64 i;
+};
+
+bool large_tests_enabled ()
+{
+    return std::getenv("KXH_LARGE_TESTS") != nullptr;
+}
+
+// More than 2^32 symbols, 2^31 of one value, and 2^32 data bits: set
+// KXH_LARGE_TESTS to run it. It needs about 1.7 GB and a minute or two.
+BOOST_AUTO_TEST_CASE(large_input, *boost::unit_test::precondition([] (boost::unit_test::test_unit_id) {
+    return large_tests_enabled();
+}))
+{
+    const U64 n = (U64(1) << 32) + (U64(1) << 20);
+    BinaryBlob blob = kxh::encode<char>(PatternIterator(0), PatternIterator(n));
+    BOOST_CHECK_EQUAL(decoded_size<char>(blob), n);
+
+    EncodedView<char> view(blob);
+    FrequencyMap<char> hist = view.histogram();
+    BOOST_CHECK_EQUAL(hist['a'], n - n / 16);
+    BOOST_CHECK_GT(hist['a'], (U64) std::numeric_limits<int>::max());
+    BOOST_CHECK_EQUAL(hist['b'] + hist['c'] + hist['d'], n / 16);
+
+    DecodedRange<char> range(blob);
+    BOOST_CHECK(std::equal(range.begin(), range.end(), PatternIterator(0)));
+}
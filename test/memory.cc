@@ -0,0 +1,192 @@
+// Checks the memory accounting and memory resource support against the
+// allocations actually made.
+
+#include <boost/test/unit_test.hpp>
+
+#include <kxhuffman/huffman.h>
+
+#include <iterator>
+#include <memory_resource>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace kxh;
+
+namespace
+{
+
+/// Count the bytes allocated from the upstream resource.
+class CountingResource : public std::pmr::memory_resource
+{
+public:
+
+    explicit CountingResource (std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+        : upstream(upstream), live(0), peak(0), total(0) {}
+
+    std::size_t live_bytes () const { return live; }
+    std::size_t peak_bytes () const { return peak; }
+    std::size_t total_bytes () const { return total; }
+
+private:
+
+    void* do_allocate (std::size_t bytes, std::size_t align) override {
+        void* p = upstream->allocate(bytes, align);
+        live += bytes;
+        total += bytes;
+        peak = std::max(peak, live);
+        return p;
+    }
+
+    void do_deallocate (void* p, std::size_t bytes, std::size_t align) override {
+        live -= bytes;
+        upstream->deallocate(p, bytes, align);
+    }
+
+    bool do_is_equal (const std::pmr::memory_resource& that) const noexcept override {
+        return this == &that;
+    }
+
+    std::pmr::memory_resource* upstream;
+    std::size_t live;
+    std::size_t peak;
+    std::size_t total;
+};
+
+/// Replace the default memory resource for the lifetime of the object.
+struct DefaultResource
+{
+    explicit DefaultResource (std::pmr::memory_resource* mr)
+        : previous(std::pmr::set_default_resource(mr)) {}
+
+    ~DefaultResource () {
+        std::pmr::set_default_resource(previous);
+    }
+
+    std::pmr::memory_resource* previous;
+};
+
+std::vector<U16> make_samples (std::size_t n)
+{
+    std::mt19937 rng(3);
+    std::normal_distribution<double> dist(0, 300);
+    std::vector<U16> data(n);
+    for (U16& x : data)
+        x = (U16) (int) dist(rng);
+    return data;
+}
+
+} // namespace
+
+/// Check the stats of encode() and decode() on the sequence against the
+/// allocations they make, and against the bounds.
+template <class T, class cont_t>
+void check_accounting (const cont_t& data)
+{
+    MemoryStats stats;
+    CountingResource enc;
+    BinaryBlob blob = encode<T>(data.begin(), data.end(), &stats, &enc);
+
+    // the stats are measured
+    BOOST_CHECK_EQUAL(stats.peak(), enc.peak_bytes());
+    BOOST_CHECK_EQUAL(stats.allocated(), enc.total_bytes());
+    BOOST_CHECK_LE(enc.peak_bytes(), encode_footprint<T>(data.size()).peak());
+    BOOST_CHECK_GT(stats.frequencies.allocated, 0u);
+    BOOST_CHECK_GE(stats.output.allocated, container_bytes(blob));
+
+    CountingResource dec;
+    std::pmr::vector<T> out(&dec);
+    decode<T>(blob, out, &stats, &dec);
+
+    BOOST_CHECK(std::equal(out.begin(), out.end(), data.begin(), data.end()));
+    BOOST_CHECK_EQUAL(stats.code.peak, 0u);
+    BOOST_CHECK_EQUAL(stats.peak(), dec.peak_bytes());
+    BOOST_CHECK_EQUAL(stats.allocated(), dec.total_bytes());
+    BOOST_CHECK_LE(dec.peak_bytes(), decode_footprint<T>(data.size()).peak());
+}
+
+BOOST_AUTO_TEST_CASE(memory_accounting)
+{
+    // wide symbols
+    check_accounting<U16>(make_samples(100000));
+
+    // bytes, with and without the pair table
+    std::string text;
+    for (int i = 0; i < 20000; ++i)
+        text += "the quick brown fox ";
+    check_accounting<char>(text);
+    check_accounting<char>(std::string("a short text"));
+
+    // the pair table only counts towards the bound of large byte inputs
+    BOOST_CHECK_LT(encode_footprint<char>(1000).peak(), 65536 * sizeof(U32));
+    BOOST_CHECK_GT(encode_footprint<char>(pair_table_min_symbols).code.peak,
+                   65536 * sizeof(U32));
+
+    // a single symbol, which has an empty code
+    check_accounting<U32>(std::vector<U32>(5000, 7));
+
+    // an LSB-first blob
+    const std::vector<U16> data = make_samples(10000);
+    BinaryBlob blob = encode_lsb<U16>(data.begin(), data.end());
+    MemoryStats stats;
+    CountingResource dec;
+    std::pmr::vector<U16> out(&dec);
+    decode<U16>(blob, out, &stats, &dec);
+    BOOST_CHECK(std::equal(out.begin(), out.end(), data.begin(), data.end()));
+    BOOST_CHECK_EQUAL(stats.peak(), dec.peak_bytes());
+    BOOST_CHECK_EQUAL(stats.allocated(), dec.total_bytes());
+    BOOST_CHECK_LE(dec.peak_bytes(), decode_footprint<U16>(data.size()).peak());
+}
+
+BOOST_AUTO_TEST_CASE(memory_resource)
+{
+    const std::vector<U16> data = make_samples(10000);
+    const std::string text = "all per-call allocations come from the arena";
+
+    CountingResource arena_upstream;
+    {
+        std::pmr::monotonic_buffer_resource arena(&arena_upstream);
+        // any allocation from the default resource throws
+        DefaultResource null_default(std::pmr::null_memory_resource());
+
+        BinaryBlob blob = encode<U16>(data.begin(), data.end(), nullptr, &arena);
+        std::pmr::vector<U16> out(&arena);
+        decode<U16>(blob, out, nullptr, &arena);
+        BOOST_CHECK(std::equal(out.begin(), out.end(), data.begin(), data.end()));
+
+        BinaryBlob text_blob = encode<char>(text.begin(), text.end(), nullptr, &arena);
+        std::pmr::string text_out(&arena);
+        decode<char>(text_blob, text_out, nullptr, &arena);
+        BOOST_CHECK_EQUAL(text_out, text.c_str());
+
+        std::vector<char> buf(text.size());
+        decode<char>(text_blob, buf.data(), buf.size(), &arena);
+        BOOST_CHECK(std::equal(buf.begin(), buf.end(), text.begin()));
+
+        // the other entry points
+        BinaryBlob indexed = encode_indexed<U16>(data.begin(), data.end(), 100, &arena);
+        BOOST_CHECK_EQUAL(decoded_size<U16>(indexed, &arena), data.size());
+        std::pmr::vector<U16> range(&arena);
+        decode_range<U16>(indexed, 5000, 10, std::back_inserter(range), &arena);
+        BOOST_CHECK(std::equal(range.begin(), range.end(), data.begin() + 5000));
+        InlineExecutor serial;
+        BOOST_CHECK(encode_parallel<U16>(data.begin(), data.end(), serial, 4, &arena) == blob);
+        std::pmr::vector<U16> parallel_out(&arena);
+        decode_parallel<U16>(indexed, parallel_out, serial, &arena);
+        BOOST_CHECK(parallel_out == out);
+        BinaryBlob lsb = encode_lsb<U16>(data.begin(), data.end(), &arena);
+        BinaryBlob sampled = encode_sampled<U16>(data.begin(), data.end(), 0.1, nullptr, &arena);
+        for (const BinaryBlob* b : { &lsb, &sampled })
+        {
+            std::pmr::vector<U16> decoded(&arena);
+            decode<U16>(*b, decoded, nullptr, &arena);
+            BOOST_CHECK(decoded == out);
+        }
+
+        HuffmanTree<char> tree(text.begin(), text.end(), &arena);
+        Table<char> table = tree.make_table();
+        BOOST_CHECK(table.get_allocator().resource() == &arena);
+        BOOST_CHECK(table.begin()->second.get_allocator().resource() == &arena);
+    }
+    BOOST_CHECK_EQUAL(arena_upstream.live_bytes(), 0u);
+}
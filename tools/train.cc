@@ -0,0 +1,152 @@
+// Training workload for profile-guided builds of the kxhuffman library.
+//
+// Generates a deterministic corpus in memory and round-trips it through the
+// library's encoders and decoders. Run by 'make pgo' between the instrumented
+// and the optimised build; exits with a non-zero status if a round trip fails.
+
+#include <kxhuffman/huffman.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace kxh;
+
+/// xorshift64*, so the corpus is the same on every platform.
+class Random
+{
+public:
+
+    explicit Random (U64 seed) : state(seed) {}
+
+    U64 next () {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+
+    /// Return a number in [0,1).
+    double uniform () {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+
+    U64 state;
+};
+
+/// English-like text: words drawn from a Zipf distribution.
+std::string make_text (Random& rng, std::size_t size)
+{
+    static const char* words[] = {
+        "the", "of", "and", "to", "a", "in", "is", "it", "that", "was",
+        "for", "on", "are", "with", "as", "his", "they", "be", "at", "one",
+        "have", "this", "from", "or", "had", "by", "word", "but", "what",
+        "some", "we", "can", "out", "other", "were", "all", "there", "when",
+        "up", "use", "your", "how", "said", "an", "each", "she", "which",
+        "do", "their", "time", "if", "will", "way", "about", "many", "then",
+        "them", "write", "would", "like", "so", "these", "her", "long",
+    };
+    const std::size_t num_words = sizeof(words) / sizeof(words[0]);
+
+    std::string text;
+    text.reserve(size + 16);
+    while (text.size() < size)
+    {
+        std::size_t w = (std::size_t) (std::pow(num_words, rng.uniform())) - 1;
+        text += words[w];
+        text += rng.next() % 12 == 0 ? ".\n" : " ";
+    }
+    text.resize(size);
+    return text;
+}
+
+/// Bytes with a geometric distribution, typical of residuals.
+std::vector<U8> make_skewed (Random& rng, std::size_t size)
+{
+    std::vector<U8> data(size);
+    for (U8& x : data)
+    {
+        U8 v = 0;
+        while (v < 255 && rng.next() % 4 != 0)
+            v++;
+        x = v;
+    }
+    return data;
+}
+
+/// Uniformly distributed bytes, the worst case for the encoder.
+std::vector<U8> make_uniform (Random& rng, std::size_t size)
+{
+    std::vector<U8> data(size);
+    for (U8& x : data)
+        x = (U8) rng.next();
+    return data;
+}
+
+/// 16-bit samples of a random walk, with a wide alphabet.
+std::vector<U16> make_samples (Random& rng, std::size_t size)
+{
+    std::vector<U16> data(size);
+    U16 v = 32768;
+    for (U16& x : data)
+    {
+        v = (U16) (v + (int) (rng.next() % 33) - 16);
+        x = v;
+    }
+    return data;
+}
+
+bool failed = false;
+
+void check (bool ok, const char* what)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "train: %s round trip failed\n", what);
+        failed = true;
+    }
+}
+
+template <class T, class cont_t>
+void train (const cont_t& data, const char* what)
+{
+    BinaryBlob blob = encode<T>(data.begin(), data.end());
+    cont_t out;
+    decode<T>(blob, out);
+    check(out == data, what);
+
+    std::vector<T> buf(decoded_size<T>(blob));
+    decode<T>(blob, buf.data(), buf.size());
+    check(std::equal(buf.begin(), buf.end(), data.begin()), what);
+
+    BinaryBlob indexed = encode_indexed<T>(data.begin(), data.end(), 4096);
+    const std::size_t first = data.size() / 3, count = data.size() / 10;
+    decode_range<T>(indexed, first, count, buf.data());
+    check(std::equal(buf.begin(), buf.begin() + count, data.begin() + first), what);
+
+    check(encode_parallel<T>(data.begin(), data.end()) == blob, what);
+}
+
+int main (int argc, char** argv)
+{
+    // corpus size in bytes per data set
+    std::size_t size = argc > 1 ? strtoul(argv[1], nullptr, 10) : (1 << 20);
+    if (size == 0)
+    {
+        fprintf(stderr, "Usage: %s [corpus size]\n", argv[0]);
+        return 1;
+    }
+
+    Random rng(0x6B786875666D616EULL);
+    train<char>(make_text(rng, size), "text");
+    train<U8>(make_skewed(rng, size), "skewed");
+    train<U8>(make_uniform(rng, size), "uniform");
+    train<U16>(make_samples(rng, size / 2), "samples");
+
+    return failed ? 1 : 0;
+}